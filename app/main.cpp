@@ -1,5 +1,6 @@
 #include <QApplication>
 #include <QClipboard>
+#include <QCommandLineParser>
 #include <QDebug>
 #include <QMainWindow>
 #include <QRegularExpression>
@@ -7,29 +8,47 @@
 
 #include <qvterm.hpp>
 
-// clang-format off
-constexpr const char *urlMatch =
-    R"((?:https?://|ftp://|news://|mailto:|file://|\bwww\.))"
-    R"([\w\-\@;\/?:&=%\$.+!*\x27,~#]*)"
-    "("
-        R"(\([\w\-\@;\/?:&=%\$.+!*\x27,~#]*\))"
-        "|"
-        R"([\w\-\@;\/?:&=%\$+*~])"
-    ")+";
-// clang-format on
-
 int main(int argc, char **argv)
 {
     QApplication::setAttribute(Qt::AA_EnableHighDpiScaling, true);
     QApplication app(argc, argv);
 
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption({"record", "Record the session to <file>.", "file"});
+    parser.addOption({"replay", "Replay <file> instead of starting a shell.", "file"});
+    parser.addOption({"fast", "Replay as fast as possible rather than at the recorded speed."});
+    parser.addOption({"no-sync", "Show synchronized updates while they are drawn rather than once they are complete."});
+    parser.process(app);
+
     QMainWindow win{};
     QVTerm qvterm{};
 
     win.setCentralWidget(&qvterm);
-    win.show();
+    qvterm.setSynchronizedUpdates(!parser.isSet("no-sync"));
+
+    if (parser.isSet("replay")) {
+        if (!qvterm.replay(parser.value("replay"), !parser.isSet("fast")))
+            return 1;
+
+        win.connect(&qvterm, &QVTerm::replayFinished, [&qvterm]() {
+            ReplayStats stats = qvterm.replayStats();
+            qInfo("replayed %llu bytes: parse %.1f ms, paint %.1f ms, %llu frames, %llu torn",
+                    static_cast<unsigned long long>(stats.bytes),
+                    static_cast<double>(stats.parseNs) / 1e6,
+                    static_cast<double>(stats.paintNs) / 1e6,
+                    static_cast<unsigned long long>(stats.frames),
+                    static_cast<unsigned long long>(stats.tornFrames));
+            QCoreApplication::exit();
+        });
+        win.show();
+    } else {
+        if (parser.isSet("record") && !qvterm.record(parser.value("record")))
+            return 1;
 
-    qvterm.start();
+        win.show();
+        qvterm.start();
+    }
     qvterm.setFocus();
 
     win.connect(&qvterm, &QVTerm::titleChanged, [&win](QString title) {
@@ -0,0 +1,311 @@
+#include <QApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QString>
+#include <QTextStream>
+
+#include <qvterm.hpp>
+#include <recording.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * Replay synthetic output through a QVTerm as fast as it goes and report how
+ * quickly it was parsed and painted.  Runs on the offscreen platform unless
+ * QT_QPA_PLATFORM says otherwise, so no display is needed.
+ *
+ * Output is one JSON object per line.
+ **/
+
+namespace {
+constexpr int cols = 120;
+constexpr int rows = 40;
+
+// Chunks the size of a PTY read
+constexpr int chunk = 4096;
+
+QByteArray ascii(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+    while (out.size() < bytes) {
+        int len = rand_r(&seed) % cols;
+        for (int i = 0; i < len; ++i)
+            out.append(static_cast<char>(' ' + rand_r(&seed) % 95));
+        out.append("\r\n");
+    }
+    return out;
+}
+
+QByteArray sgr(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+    while (out.size() < bytes) {
+        for (int i = 0; i < cols; ++i) {
+            if (i % 2) {
+                out.append(QString("\x1b[38;5;%1;48;5;%2m")
+                                   .arg(rand_r(&seed) % 256)
+                                   .arg(rand_r(&seed) % 256)
+                                   .toLatin1());
+            } else {
+                out.append(QString("\x1b[38;2;%1;%2;%3m")
+                                   .arg(rand_r(&seed) % 256)
+                                   .arg(rand_r(&seed) % 256)
+                                   .arg(rand_r(&seed) % 256)
+                                   .toLatin1());
+            }
+            out.append(static_cast<char>('a' + i % 26));
+        }
+        out.append("\x1b[m\r\n");
+    }
+    return out;
+}
+
+QByteArray unicode(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+    while (out.size() < bytes) {
+        QString line;
+        for (int col = 0; col < cols - 1;) {
+            switch (rand_r(&seed) % 3) {
+                case 0:
+                    // CJK, two columns wide
+                    line += QChar(0x4e00 + rand_r(&seed) % 0x5000);
+                    col += 2;
+                    break;
+                case 1:
+                    // Combining accents
+                    line += QChar('a' + rand_r(&seed) % 26);
+                    line += QChar(0x0301);
+                    line += QChar(0x0323);
+                    col += 1;
+                    break;
+                default:
+                    line += QChar(0x3b1 + rand_r(&seed) % 24);
+                    col += 1;
+                    break;
+            }
+        }
+        out.append(line.toUtf8());
+        out.append("\r\n");
+    }
+    return out;
+}
+
+QByteArray scrollRegion(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+
+    // Scroll the middle of the screen, like a pager or an editor would
+    out.append(QString("\x1b[5;%1r\x1b[%1;1H").arg(rows - 5).toLatin1());
+    while (out.size() < bytes) {
+        int len = rand_r(&seed) % cols;
+        for (int i = 0; i < len; ++i)
+            out.append(static_cast<char>('!' + rand_r(&seed) % 94));
+        out.append("\r\n");
+    }
+    out.append("\x1b[r");
+    return out;
+}
+
+QByteArray altScreen(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+
+    // Full screen application redrawing everything, every time
+    out.append("\x1b[?1049h");
+    while (out.size() < bytes) {
+        out.append("\x1b[H");
+        for (int row = 0; row < rows; ++row) {
+            out.append(QString("\x1b[%1;1H\x1b[3%2m").arg(row + 1).arg(rand_r(&seed) % 8).toLatin1());
+            for (int i = 0; i < cols; ++i)
+                out.append(static_cast<char>('A' + rand_r(&seed) % 26));
+        }
+    }
+    out.append("\x1b[m\x1b[?1049l");
+    return out;
+}
+
+QByteArray styledRedraw(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+
+    // Full screen redraws of text mixing bold, italic, underline and strike,
+    // so every frame paints runs from each font variant
+    const char *styles[] = {"0", "1", "3", "4", "9", "1;3", "1;4", "3;9"};
+    out.append("\x1b[?1049h");
+    while (out.size() < bytes) {
+        for (int row = 0; row < rows; ++row) {
+            out.append(QString("\x1b[%1;1H").arg(row + 1).toLatin1());
+            for (int col = 0; col < cols;) {
+                int len = std::min(cols - col, 4 + rand_r(&seed) % 12);
+                out.append(QString("\x1b[0;%1m").arg(styles[rand_r(&seed) % 8]).toLatin1());
+                for (int i = 0; i < len; ++i)
+                    out.append(static_cast<char>('!' + rand_r(&seed) % 94));
+                col += len;
+            }
+        }
+    }
+    out.append("\x1b[m\x1b[?1049l");
+    return out;
+}
+
+QByteArray coloredTui(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+
+    // Full screen redraws of panes and bars with their own backgrounds, like
+    // htop or tig
+    out.append("\x1b[?1049h");
+    while (out.size() < bytes) {
+        for (int row = 0; row < rows; ++row) {
+            out.append(QString("\x1b[%1;1H").arg(row + 1).toLatin1());
+            for (int col = 0; col < cols;) {
+                int len = std::min(cols - col, 8 + rand_r(&seed) % 40);
+                out.append(QString("\x1b[38;5;%1;48;5;%2m")
+                                   .arg(rand_r(&seed) % 256)
+                                   .arg(16 + rand_r(&seed) % 216)
+                                   .toLatin1());
+                for (int i = 0; i < len; ++i)
+                    out.append(static_cast<char>(i % 3 ? 'a' + rand_r(&seed) % 26 : ' '));
+                col += len;
+            }
+        }
+    }
+    out.append("\x1b[m\x1b[?1049l");
+    return out;
+}
+
+QByteArray syncRedraw(int bytes)
+{
+    QByteArray out;
+    unsigned seed = 1;
+
+    // Redraws of the whole screen, each bracketed as a synchronized update the
+    // way neovim does, and spread over several reads
+    out.append("\x1b[?1049h");
+    while (out.size() < bytes) {
+        out.append("\x1b[?2026h");
+        for (int row = 0; row < rows; ++row) {
+            out.append(QString("\x1b[%1;1H\x1b[3%2m").arg(row + 1).arg(rand_r(&seed) % 8).toLatin1());
+            for (int i = 0; i < cols; ++i)
+                out.append(static_cast<char>('a' + rand_r(&seed) % 26));
+        }
+        out.append("\x1b[m\x1b[?2026l");
+    }
+    out.append("\x1b[?1049l");
+    return out;
+}
+
+bool writeRecording(const QString &path, const QByteArray &data)
+{
+    Recorder recorder;
+    if (!recorder.open(path))
+        return false;
+
+    recorder.resize(rows, cols);
+    for (int i = 0; i < data.size(); i += chunk)
+        recorder.data(data.constData() + i, static_cast<size_t>(std::min(chunk, data.size() - i)));
+    return true;
+}
+
+// Nanoseconds per cell to snapshot a screenful of rows starting at start
+double snapshotNs(const QVTerm &qvterm, int start)
+{
+    constexpr int rounds = 200;
+    std::vector<VTermScreenCell> cells{};
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < rounds; ++i)
+        qvterm.snapshotRows(start, start + rows, &cells);
+    return static_cast<double>(timer.nsecsElapsed()) / (rounds * rows * cols);
+}
+
+double percentile(std::vector<qint64> ns, int pct)
+{
+    if (ns.empty())
+        return 0;
+
+    std::sort(ns.begin(), ns.end());
+    return static_cast<double>(ns[(ns.size() - 1) * static_cast<size_t>(pct) / 100]);
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QApplication app(argc, argv);
+
+    int mib = argc > 1 ? atoi(argv[1]) : 16;
+    int bytes = mib << 20;
+    QTextStream out(stdout);
+
+    struct Workload {
+        const char *name;
+        QByteArray (*generate)(int bytes);
+        bool sync;
+    };
+    const Workload workloads[] = {
+            {"ascii", ascii, true},
+            {"sgr", sgr, true},
+            {"unicode", unicode, true},
+            {"scroll_region", scrollRegion, true},
+            {"altscreen", altScreen, true},
+            {"styled_redraw", styledRedraw, true},
+            {"colored_tui", coloredTui, true},
+            {"sync_redraw", syncRedraw, true},
+            {"sync_redraw_unsynced", syncRedraw, false},
+    };
+
+    for (const auto &workload : workloads) {
+        QString path = QDir::tempPath() + "/qvterm_bench_" + workload.name + ".rec";
+        if (!writeRecording(path, workload.generate(bytes)))
+            return 1;
+
+        QVTerm qvterm{};
+        qvterm.setSynchronizedUpdates(workload.sync);
+        qvterm.resize(1280, 960);
+        qvterm.show();
+
+        QEventLoop loop;
+        QObject::connect(&qvterm, &QVTerm::replayFinished, &loop, &QEventLoop::quit);
+
+        QElapsedTimer timer;
+        timer.start();
+        if (!qvterm.replay(path, false))
+            return 1;
+        loop.exec();
+        qint64 wallNs = timer.nsecsElapsed();
+        QFile::remove(path);
+
+        ReplayStats stats = qvterm.replayStats();
+        out << "{\"bench\": \"" << workload.name
+            << "\", \"bytes\": " << static_cast<quint64>(stats.bytes)
+            << ", \"parse_mb_per_s\": " << static_cast<double>(stats.bytes) * 1e3 / static_cast<double>(stats.parseNs)
+            << ", \"mb_per_s\": " << static_cast<double>(stats.bytes) * 1e3 / static_cast<double>(wallNs)
+            << ", \"frames\": " << static_cast<quint64>(stats.frames)
+            << ", \"torn_frames\": " << static_cast<quint64>(stats.tornFrames)
+            << ", \"frames_per_s\": " << static_cast<double>(stats.frames) * 1e9 / static_cast<double>(wallNs)
+            << ", \"paint_p50_us\": " << percentile(stats.paints, 50) / 1e3
+            << ", \"paint_p99_us\": " << percentile(stats.paints, 99) / 1e3
+            << ", \"scrollbar_updates_saved\": " << static_cast<quint64>(qvterm.scrollbarUpdatesSaved())
+            << ", \"screen_snapshot_ns_per_cell\": " << snapshotNs(qvterm, 0)
+            << ", \"scrollback_snapshot_ns_per_cell\": " << snapshotNs(qvterm, -rows)
+            << "}\n";
+        out.flush();
+    }
+
+    return 0;
+}
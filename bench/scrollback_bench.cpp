@@ -0,0 +1,229 @@
+#include <QElapsedTimer>
+#include <QString>
+#include <QTextStream>
+
+#include <palette.hpp>
+#include <scrollback.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <vterm.h>
+}
+
+/**
+ * Fill a scrollback with build log looking lines and report the memory used
+ * per line, how quickly lines are pushed and fetched back, and how quickly the
+ * trigram index narrows down a search.
+ *
+ * Output is one JSON object per line.
+ **/
+
+namespace {
+constexpr int cols = 120;
+constexpr int rows = 40;
+
+// clang-format off
+const char *words[] = {
+    "[ 42%]", "Building", "CXX", "object", "qvterm/CMakeFiles/qvterm.dir/scrollback.cpp.o",
+    "Linking", "shared", "library", "lib/libqvterm.so", "warning:", "unused", "variable",
+    "error:", "expected", "';'", "before", "'}'", "token", "make[2]:", "Leaving", "directory",
+    "/home/user/src/sff/build", "Scanning", "dependencies", "of", "target", "sff",
+};
+// clang-format on
+constexpr size_t nwords = sizeof(words) / sizeof(words[0]);
+
+void fillLine(VTermScreenCell *cells, unsigned *seed)
+{
+    memset(cells, 0, sizeof(VTermScreenCell) * cols);
+
+    int len = rand_r(seed) % cols;
+    int col = 0;
+    while (col < len) {
+        // Every so often a location or an address, which is where most of
+        // the distinct trigrams of a real build log come from
+        char word[64];
+        switch (rand_r(seed) % 8) {
+            case 0:
+                snprintf(word, sizeof(word), "src/unit%d.cpp:%d:%d:", rand_r(seed) % 500, rand_r(seed) % 3000, rand_r(seed) % 80);
+                break;
+            case 1:
+                snprintf(word, sizeof(word), "0x%08x", static_cast<unsigned>(rand_r(seed)));
+                break;
+            default:
+                snprintf(word, sizeof(word), "%s", words[static_cast<size_t>(rand_r(seed)) % nwords]);
+                break;
+        }
+        for (const char *c = word; *c && col < cols; ++c)
+            cells[col++].chars[0] = static_cast<uint32_t>(*c);
+        col++;
+    }
+
+    for (int i = 0; i < cols; ++i) {
+        cells[i].width = 1;
+        vterm_color_rgb(&cells[i].fg, 0xeb, 0xdb, 0xbd);
+        vterm_color_rgb(&cells[i].bg, 0x28, 0x28, 0x28);
+    }
+}
+
+// Nanoseconds to push lines, with something rare to look for every 100k
+qint64 push(Scrollback *scrollback, const Palette &palette, size_t lines)
+{
+    unsigned seed = 1;
+    std::vector<VTermScreenCell> cells(cols);
+    QElapsedTimer timer;
+    timer.start();
+    for (size_t i = 0; i < lines; ++i) {
+        fillLine(cells.data(), &seed);
+
+        if (i % 100000 == 50000) {
+            cells[0].chars[0] = 'Z';
+            cells[1].chars[0] = 'Q';
+            cells[2].chars[0] = 'X';
+        }
+
+        scrollback->emplace(cols, cells.data(), palette, false);
+    }
+    return timer.nsecsElapsed();
+}
+
+// Nanoseconds to fetch a screenful of rows starting at each of starts
+std::vector<qint64> fetch(const Scrollback &scrollback, const std::vector<size_t> &starts)
+{
+    std::vector<VTermScreenCell> cells(cols);
+    std::vector<qint64> ns;
+    QElapsedTimer timer;
+    for (size_t start : starts) {
+        timer.restart();
+        for (size_t row = start; row < start + rows; ++row)
+            scrollback.fetchRow(row, cols, cells.data());
+        ns.push_back(timer.nsecsElapsed());
+    }
+    std::sort(ns.begin(), ns.end());
+    return ns;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    size_t lines = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+    Scrollback scrollback(lines, 5000);
+    QTextStream out(stdout);
+
+    qint64 pushNs = push(&scrollback, palette, lines);
+
+    ScrollbackUsage usage = scrollback.usage();
+    out << "{\"bench\": \"push\", \"lines\": " << static_cast<quint64>(usage.lines)
+        << ", \"bytes\": " << static_cast<quint64>(usage.bytes)
+        << ", \"bytes_per_line\": " << usage.bytesPerLine()
+        << ", \"bytes_per_100k_lines\": " << static_cast<quint64>(usage.bytesPerLine() * 100000)
+        << ", \"index_bytes\": " << static_cast<quint64>(usage.indexBytes)
+        << ", \"index_bytes_per_line\": " << static_cast<double>(usage.indexBytes) / static_cast<double>(usage.lines)
+        << ", \"lines_per_s\": " << static_cast<double>(lines) * 1e9 / static_cast<double>(pushNs)
+        << "}\n";
+
+    // Which groups of lines really contain each query, and which contain
+    // every trigram of it, to tell how many of the groups the index lets
+    // through it shouldn't have
+    const char *queries[] = {"ZQX", "error: expected", "libqvterm", "unit123.cpp:45", "no such text"};
+    size_t ngroups = (lines + TrigramIndex::groupLines - 1) / TrigramIndex::groupLines;
+    std::vector<std::vector<bool>> contains;
+    std::vector<std::vector<bool>> possible;
+    for (const char *query : queries) {
+        std::u32string needle(query, query + strlen(query));
+        std::vector<bool> groups(ngroups);
+        std::vector<std::vector<bool>> trigrams(needle.size() - 2, std::vector<bool>(ngroups));
+        std::u32string text;
+        uint64_t serial = scrollback.serial();
+        for (uint64_t seq = serial - scrollback.size(); seq < serial; ++seq) {
+            auto sbl = scrollback.line(static_cast<size_t>(serial - 1 - seq));
+            text.clear();
+            for (int col = 0; col < sbl.ncells(); ++col) {
+                uint32_t ch = sbl.chars(sbl.cell(col))[0];
+                text += static_cast<char32_t>(ch ? ch : ' ');
+            }
+            if (text.find(needle) != std::u32string::npos)
+                groups[seq / TrigramIndex::groupLines] = true;
+            for (size_t i = 0; i < trigrams.size(); ++i) {
+                if (text.find(needle.substr(i, 3)) != std::u32string::npos)
+                    trigrams[i][seq / TrigramIndex::groupLines] = true;
+            }
+        }
+        contains.push_back(std::move(groups));
+
+        std::vector<bool> all(ngroups);
+        for (size_t group = 0; group < ngroups; ++group)
+            all[group] = std::all_of(trigrams.begin(), trigrams.end(), [&](const std::vector<bool> &t) { return t[group]; });
+        possible.push_back(std::move(all));
+    }
+
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); ++q) {
+        const char *query = queries[q];
+        constexpr int rounds = 50;
+        std::vector<qint64> ns;
+        LineFilter filter;
+        QElapsedTimer timer;
+        for (int i = 0; i < rounds; ++i) {
+            timer.restart();
+            filter = scrollback.filter(QStringList(QString(query)));
+            ns.push_back(timer.nsecsElapsed());
+        }
+        std::sort(ns.begin(), ns.end());
+
+        size_t wanted = 0;
+        size_t matching = 0;
+        size_t trigrams = 0;
+        uint64_t serial = scrollback.serial();
+        for (uint64_t seq = serial - scrollback.size(); seq < serial; ++seq) {
+            wanted += filter.wanted(seq, seq);
+            matching += contains[q][seq / TrigramIndex::groupLines];
+            trigrams += possible[q][seq / TrigramIndex::groupLines];
+        }
+
+        out << "{\"bench\": \"query\", \"text\": \"" << query
+            << "\", \"p50_us\": " << static_cast<double>(ns[rounds / 2]) / 1e3
+            << ", \"p99_us\": " << static_cast<double>(ns[rounds * 99 / 100]) / 1e3
+            << ", \"lines_searched\": " << static_cast<double>(wanted) / static_cast<double>(scrollback.size())
+            << ", \"lines_possible\": " << static_cast<double>(trigrams) / static_cast<double>(scrollback.size())
+            << ", \"lines_needed\": " << static_cast<double>(matching) / static_cast<double>(scrollback.size())
+            << "}\n";
+    }
+
+    // Screenfuls just behind the screen, then ones far enough apart that each
+    // lands in a block that has to be decompressed first
+    constexpr int rounds = 200;
+    std::vector<size_t> hot(rounds, 0);
+    std::vector<size_t> cold;
+    for (size_t start = 6000; start + rows <= scrollback.size() && cold.size() < rounds; start += 1000)
+        cold.push_back(start);
+    if (!cold.empty()) {
+        std::vector<qint64> hotNs = fetch(scrollback, hot);
+        std::vector<qint64> coldNs = fetch(scrollback, cold);
+        out << "{\"bench\": \"fetch\", \"rows\": " << rows
+            << ", \"hot_p50_us\": " << static_cast<double>(hotNs[hotNs.size() / 2]) / 1e3
+            << ", \"cold_p50_us\": " << static_cast<double>(coldNs[coldNs.size() / 2]) / 1e3
+            << ", \"cold_p99_us\": " << static_cast<double>(coldNs[(coldNs.size() - 1) * 99 / 100]) / 1e3
+            << "}\n";
+    }
+
+    // Pushing into a full scrollback, where every line evicts another
+    Scrollback full(5000, 5000);
+    push(&full, palette, 5000);
+    pushNs = push(&full, palette, lines);
+    out << "{\"bench\": \"push_full\", \"lines\": " << static_cast<quint64>(lines)
+        << ", \"bytes_per_line\": " << full.usage().bytesPerLine()
+        << ", \"lines_per_s\": " << static_cast<double>(lines) * 1e9 / static_cast<double>(pushNs)
+        << "}\n";
+
+    vterm_free(vterm);
+    return 0;
+}
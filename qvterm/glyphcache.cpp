@@ -0,0 +1,71 @@
+#include "glyphcache.hpp"
+
+#include <QString>
+
+void GlyphCache::setFont(const QFont &font, int dpi)
+{
+    m_font = font;
+    m_dpi = dpi;
+    for (auto &v : m_variants)
+        v = Variant();
+}
+
+const QRawFont &GlyphCache::rawFont(int style)
+{
+    return variant(style).raw;
+}
+
+int GlyphCache::append(int style, const uint32_t *chars, int max, QVector<quint32> *glyphs)
+{
+    Variant &v = variant(style);
+
+    // Combining characters have to be shaped together, they're rare enough
+    // not to bother caching
+    if (max > 1 && chars[1]) {
+        int n = 1;
+        while (n < max && chars[n])
+            ++n;
+        QVector<quint32> shaped = v.raw.glyphIndexesForString(
+                QString::fromUcs4(chars, n));
+        glyphs->append(shaped);
+        return shaped.size();
+    }
+
+    uint32_t ch = chars[0];
+    quint32 *slot = ch < v.ascii.size() ? &v.ascii[ch] : nullptr;
+    if (slot && *slot != unknown) {
+        glyphs->append(*slot);
+        return 1;
+    }
+    if (!slot) {
+        auto it = v.other.constFind(ch);
+        if (it != v.other.constEnd()) {
+            glyphs->append(*it);
+            return 1;
+        }
+    }
+
+    QVector<quint32> shaped = v.raw.glyphIndexesForString(QString::fromUcs4(&ch, 1));
+    quint32 glyph = shaped.isEmpty() ? 0 : shaped[0];
+    if (slot)
+        *slot = glyph;
+    else
+        v.other.insert(ch, glyph);
+    glyphs->append(glyph);
+    return 1;
+}
+
+GlyphCache::Variant &GlyphCache::variant(int style)
+{
+    Variant &v = m_variants[static_cast<size_t>(style) & 3];
+    if (v.loaded)
+        return v;
+
+    QFont font{m_font};
+    font.setBold(style & Bold);
+    font.setItalic(style & Italic);
+    v.raw = QRawFont::fromFont(font);
+    v.ascii.fill(unknown);
+    v.loaded = true;
+    return v;
+}
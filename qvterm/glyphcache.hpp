@@ -0,0 +1,72 @@
+#pragma once
+
+#include <QFont>
+#include <QHash>
+#include <QRawFont>
+#include <QVector>
+
+#include <array>
+#include <cstdint>
+
+/**
+ * Glyph indexes for the terminal font, looked up once per character and style
+ * so that painting can build glyph runs without shaping any text.
+ *
+ * Underline and strike out are drawn by the glyph run and don't change the
+ * glyphs, so only bold and italic get their own raw font.
+ **/
+class GlyphCache {
+public:
+    enum Style {
+        Bold = 1 << 0,
+        Italic = 1 << 1,
+    };
+
+    /**
+     * Drop everything looked up for the previous font
+     *
+     * @param font  - Font to look glyphs up in
+     * @param dpi   - Logical DPI of the paint device the font is used on
+     **/
+    void setFont(const QFont &font, int dpi);
+
+    /**
+     * Logical DPI the cache was filled for
+     **/
+    int dpi() const { return m_dpi; }
+
+    /**
+     * Raw font for a style
+     *
+     * @param style - Combination of Style flags
+     **/
+    const QRawFont &rawFont(int style);
+
+    /**
+     * Append the glyph indexes for the characters of one cell
+     *
+     * @param style     - Combination of Style flags
+     * @param chars     - Characters of the cell, zero terminated if less than max
+     * @param max       - Maximum number of characters in chars
+     * @param glyphs    - Glyph indexes are appended here
+     *
+     * @return  - Number of glyph indexes appended
+     **/
+    int append(int style, const uint32_t *chars, int max, QVector<quint32> *glyphs);
+
+private:
+    static constexpr quint32 unknown = UINT32_MAX;
+
+    struct Variant {
+        bool loaded{false};
+        QRawFont raw{};
+        std::array<quint32, 128> ascii{};
+        QHash<uint32_t, quint32> other{};
+    };
+
+    Variant &variant(int style);
+
+    QFont m_font{};
+    int m_dpi{0};
+    std::array<Variant, 4> m_variants{};
+};
@@ -19,6 +19,11 @@ bool Highlight::contains(int x, int y) const
     return active() && m_region.contains(x, y);
 }
 
+bool Highlight::rowSpan(int y, int width, int *start, int *end) const
+{
+    return active() && m_region.rowSpan(y, width, start, end);
+}
+
 void Highlight::reset()
 {
     m_anchor = QPoint();
@@ -30,6 +30,18 @@ public:
      **/
     bool contains(int x, int y) const;
 
+    /**
+     * Columns of a row that are highlighted
+     *
+     * @param y     - y coordinate in VTerm space
+     * @param width - number of columns in a row
+     * @param start - set to the first highlighted column
+     * @param end   - set to the column after the last highlighted one
+     *
+     * @return  - false if nothing in the row is highlighted
+     **/
+    bool rowSpan(int y, int width, int *start, int *end) const;
+
     /**
      * Reset the highlight
      **/
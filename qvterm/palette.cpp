@@ -0,0 +1,13 @@
+#include "palette.hpp"
+
+void Palette::load(const VTermState *vts)
+{
+    for (size_t i = 0; i < m_colors.size(); ++i) {
+        vterm_state_get_palette_color(vts, static_cast<int>(i), &m_colors[i]);
+        vterm_state_convert_color_to_rgb(vts, &m_colors[i]);
+    }
+
+    vterm_state_get_default_colors(vts, &m_defaultFg, &m_defaultBg);
+    resolve(&m_defaultFg);
+    resolve(&m_defaultBg);
+}
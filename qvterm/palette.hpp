@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+extern "C" {
+#include <vterm.h>
+}
+
+/**
+ * Colors of a terminal resolved to RGB, so that resolving the color of a cell
+ * is a table lookup instead of a call into libvterm.
+ *
+ * Has to be loaded again whenever the palette or the default colors of the
+ * terminal change.
+ **/
+class Palette {
+public:
+    /**
+     * Resolve all 256 indexed colors and the defaults
+     **/
+    void load(const VTermState *vts);
+
+    /**
+     * Turn a color into plain RGB, dropping whether it was a default one, the
+     * same as vterm_state_convert_color_to_rgb() does
+     **/
+    void resolve(VTermColor *color) const
+    {
+        if (VTERM_COLOR_IS_INDEXED(color))
+            *color = m_colors[color->indexed.idx];
+        else
+            color->type = static_cast<uint8_t>(color->type & VTERM_COLOR_TYPE_MASK);
+    }
+
+    const VTermColor &defaultFg() const { return m_defaultFg; };
+    const VTermColor &defaultBg() const { return m_defaultBg; };
+
+private:
+    std::array<VTermColor, 256> m_colors{};
+    VTermColor m_defaultFg{};
+    VTermColor m_defaultBg{};
+};
@@ -0,0 +1,270 @@
+#include "ptythread.hpp"
+
+#include <QMutexLocker>
+#include <QtGlobal>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+// Reads per wakeup, so queued input isn't held up for long by a flood
+constexpr int readsPerPoll = 16;
+
+// Output to queue before input stops being fed to libvterm
+constexpr uint64_t maxQueued = 1 << 20;
+
+// Bytes of a paste queued at once
+constexpr int pasteChunk = 64 << 10;
+} // namespace
+
+PtyThread::PtyThread(int pty, VTerm *vterm, QMutex *lock, SyncUpdate *sync, Recorder *rec) :
+    m_pty(pty),
+    m_wake(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+    m_vterm(vterm),
+    m_lock(lock),
+    m_sync(sync),
+    m_recorder(rec)
+{
+    if (m_wake < 0)
+        qFatal("eventfd: %s", strerror(errno));
+
+    static auto on_output = [](const char *s, size_t len, void *user) {
+        auto p = static_cast<PtyThread *>(user);
+        p->m_output.append(s, static_cast<int>(len));
+        p->m_queued += len;
+    };
+    QMutexLocker locker(m_lock);
+    vterm_output_set_callback(m_vterm, on_output, this);
+}
+
+PtyThread::~PtyThread()
+{
+    requestInterruption();
+    wake();
+    wait();
+
+    QMutexLocker locker(m_lock);
+    vterm_output_set_callback(m_vterm, nullptr, nullptr);
+    close(m_wake);
+}
+
+bool PtyThread::send(Input input)
+{
+    size_t tail = m_inputTail.load(std::memory_order_relaxed);
+    if (tail - m_inputHead.load(std::memory_order_acquire) == inputSlots)
+        return false;
+
+    m_input[tail % inputSlots] = std::move(input);
+    m_inputTail.store(tail + 1, std::memory_order_release);
+    wake();
+    return true;
+}
+
+void PtyThread::cancelPaste()
+{
+    m_pasteCancel = true;
+    wake();
+}
+
+void PtyThread::run()
+{
+    pollfd fds[] = {
+            {m_pty, POLLIN, 0},
+            {m_wake, POLLIN, 0},
+    };
+
+    while (!isInterruptionRequested()) {
+        // Input held back while the output queue was full doesn't get another
+        // wakeup, so don't wait once there's room for it
+        bool held = (m_inputHead != m_inputTail || !m_paste.isEmpty()) && m_queued < maxQueued;
+
+        fds[0].events = static_cast<short>(POLLIN | (m_queued ? POLLOUT : 0));
+        if (poll(fds, 2, held ? 0 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            qFatal("poll pty: %s", strerror(errno));
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(m_wake, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                qWarning("read pty thread wakeup: %s", strerror(errno));
+        }
+        feedPaste();
+        feedInput();
+
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && !readPty()) {
+            emit closed();
+            return;
+        }
+        flushToPty();
+    }
+}
+
+void PtyThread::feedInput()
+{
+    // Anything typed during a paste goes after it
+    if (m_queued >= maxQueued || !m_paste.isEmpty())
+        return;
+
+    size_t head = m_inputHead.load(std::memory_order_relaxed);
+    size_t tail = m_inputTail.load(std::memory_order_acquire);
+    if (head == tail)
+        return;
+
+    QMutexLocker locker(m_lock);
+    for (; head != tail && m_paste.isEmpty(); ++head) {
+        Input input = std::move(m_input[head % inputSlots]);
+        switch (input.type) {
+            case Input::Key:
+                vterm_keyboard_key(m_vterm, input.key, input.mod);
+                break;
+            case Input::Char:
+                vterm_keyboard_unichar(m_vterm, input.ch, input.mod);
+                break;
+            case Input::Paste:
+                // Only sends the marker when the app asked for it
+                vterm_keyboard_start_paste(m_vterm);
+                m_paste = std::move(input.text);
+                m_pasteOffset = 0;
+                m_pasteCancel = false;
+                break;
+            case Input::FocusIn:
+                vterm_state_focus_in(vterm_obtain_state(m_vterm));
+                break;
+            case Input::FocusOut:
+                vterm_state_focus_out(vterm_obtain_state(m_vterm));
+                break;
+        }
+    }
+    m_inputHead.store(head, std::memory_order_release);
+}
+
+void PtyThread::feedPaste()
+{
+    if (m_paste.isEmpty())
+        return;
+
+    bool cancelled = m_pasteCancel.exchange(false);
+    int percent = static_cast<int>(m_pasteOffset * 100LL / m_paste.size());
+
+    QMutexLocker locker(m_lock);
+    while (!cancelled && m_pasteOffset < m_paste.size() && m_queued < maxQueued) {
+        int n = std::min(pasteChunk, m_paste.size() - m_pasteOffset);
+        m_output.append(m_paste.constData() + m_pasteOffset, n);
+        m_pasteOffset += n;
+        m_queued += static_cast<uint64_t>(n);
+    }
+
+    if (cancelled || m_pasteOffset == m_paste.size()) {
+        vterm_keyboard_end_paste(m_vterm);
+        m_paste.clear();
+        m_pasteOffset = 0;
+        emit pasteFinished();
+        return;
+    }
+
+    if (static_cast<int>(m_pasteOffset * 100LL / m_paste.size()) != percent)
+        emit pasteProgress(m_pasteOffset, m_paste.size());
+}
+
+void PtyThread::wake()
+{
+    uint64_t one = 1;
+    if (write(m_wake, &one, sizeof(one)) < 0)
+        qWarning("wake pty thread: %s", strerror(errno));
+}
+
+void PtyThread::flushToPty()
+{
+    while (true) {
+        if (m_outgoingOffset == m_outgoing.size()) {
+            m_outgoing.clear();
+            m_outgoingOffset = 0;
+
+            QMutexLocker locker(m_lock);
+            m_outgoing.swap(m_output);
+            if (m_outgoing.isEmpty())
+                return;
+        }
+
+        ssize_t n = write(
+                m_pty,
+                m_outgoing.constData() + m_outgoingOffset,
+                static_cast<size_t>(m_outgoing.size() - m_outgoingOffset));
+        if (n < 0) {
+            int e = errno;
+            if (e == EINTR)
+                continue;
+
+            // Picked up again once poll says the PTY is writable
+            if (e == EAGAIN || e == EWOULDBLOCK)
+                return;
+
+            // Give up on whatever is queued, including the rest of a paste,
+            // though the paste still gets its end marker so the application
+            // isn't left in bracketed paste mode
+            qCritical("write to pty: %s", strerror(e));
+            QMutexLocker locker(m_lock);
+            m_output.clear();
+            m_outgoing.clear();
+            m_outgoingOffset = 0;
+            m_queued = 0;
+            if (!m_paste.isEmpty()) {
+                vterm_keyboard_end_paste(m_vterm);
+                m_paste.clear();
+                m_pasteOffset = 0;
+                emit pasteFinished();
+            }
+            return;
+        }
+
+        m_outgoingOffset += static_cast<int>(n);
+        m_queued -= static_cast<uint64_t>(n);
+        m_written += static_cast<uint64_t>(n);
+    }
+}
+
+bool PtyThread::readPty()
+{
+    bool parsed = false;
+    for (int i = 0; i < readsPerPoll; ++i) {
+        // Linux pty buffer is fixed on page size
+        char buf[4096];
+
+        ssize_t n = read(m_pty, buf, sizeof(buf));
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+
+        if (n == 0 || (n == -1 && errno == EIO))
+            return false;
+
+        if (n < 0)
+            qFatal("read from pty: %s", strerror(errno));
+
+        QMutexLocker locker(m_lock);
+        if (m_recorder)
+            m_recorder->data(buf, static_cast<size_t>(n));
+        m_sync->write(m_vterm, buf, static_cast<size_t>(n), [this](const char *s, size_t len) {
+            m_output.append(s, static_cast<int>(len));
+            m_queued += len;
+        });
+        parsed = true;
+    }
+
+    // Recordings are most wanted after a crash, so don't leave what was just
+    // read sitting in a buffer
+    if (parsed && m_recorder) {
+        QMutexLocker locker(m_lock);
+        m_recorder->flush();
+    }
+
+    if (parsed && !m_received.exchange(true))
+        emit received();
+    return true;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "recording.hpp"
+#include "syncupdate.hpp"
+
+#include <QByteArray>
+#include <QMutex>
+#include <QThread>
+
+#include <array>
+#include <atomic>
+
+extern "C" {
+#include <vterm.h>
+}
+
+/**
+ * Reads the PTY and feeds it to libvterm, keeping a flood of output from
+ * blocking the GUI thread.
+ *
+ * The VTerm is shared with the GUI thread and only touched with the lock
+ * held, which is done for a single read at a time.  Keyboard input goes the
+ * other way through a lock-free queue, so sending it never waits on parsing.
+ *
+ * Whatever libvterm sends back is queued and written as the PTY accepts it.
+ * While too much is queued, no more input is fed to libvterm, which leaves it
+ * to back up in the input queue instead.
+ *
+ * Pastes skip libvterm apart from the bracketed paste markers.  They're queued
+ * a chunk at a time as the PTY keeps up, so that huge ones can be followed
+ * and cancelled.
+ **/
+class PtyThread : public QThread {
+    Q_OBJECT
+public:
+    /**
+     * Something to send to the terminal
+     **/
+    struct Input {
+        enum Type {
+            Key,
+            Char,
+            Paste,
+            FocusIn,
+            FocusOut,
+        };
+
+        Type type{Key};
+        VTermKey key{VTERM_KEY_NONE};
+        uint32_t ch{0};
+        VTermModifier mod{VTERM_MOD_NONE};
+
+        // UTF-8 to paste
+        QByteArray text{};
+    };
+
+    /**
+     * @param pty   - Non-blocking PTY master
+     * @param vterm - Terminal to feed, its output is written to the PTY
+     * @param lock  - Lock protecting vterm
+     * @param sync  - Feeds vterm, following synchronized updates and
+     *                answering queries about them, used with the lock held
+     * @param rec   - Recorder for what is fed to vterm, used with the lock held
+     **/
+    PtyThread(int pty, VTerm *vterm, QMutex *lock, SyncUpdate *sync, Recorder *rec = nullptr);
+    ~PtyThread() override;
+
+    /**
+     * Stop the paste in progress, whatever was queued so far is still sent
+     **/
+    void cancelPaste();
+
+    /**
+     * Allow received() to be emitted again
+     **/
+    void acknowledge() { m_received = false; }
+
+    /**
+     * Bytes waiting to be written to the PTY
+     **/
+    uint64_t queued() const { return m_queued; }
+
+    /**
+     * Total bytes written to the PTY
+     **/
+    uint64_t written() const { return m_written; }
+
+    /**
+     * Queue input for the terminal, only to be called from one thread
+     *
+     * @return  - false if the queue is full and the input was dropped
+     **/
+    bool send(Input input);
+
+signals:
+    /**
+     * Part of a paste was queued for the PTY, emitted whenever another
+     * percent of it is.
+     *
+     * @param done  - Bytes queued so far
+     * @param total - Size of the paste
+     **/
+    void pasteProgress(qint64 done, qint64 total);
+
+    /**
+     * The paste was queued completely or cancelled
+     **/
+    void pasteFinished();
+
+    /**
+     * Output was parsed.  Not emitted again until acknowledge() is called.
+     **/
+    void received();
+
+    /**
+     * The other end of the PTY went away
+     **/
+    void closed();
+
+protected:
+    void run() override;
+
+private:
+    void feedInput();
+
+    /**
+     * Queue more of the paste in progress, if there is room for it
+     **/
+    void feedPaste();
+    void wake();
+
+    /**
+     * Write as much of the queued output as the PTY takes without blocking
+     **/
+    void flushToPty();
+
+    /**
+     * Parse what is available on the PTY, a bounded amount at a time
+     *
+     * @return  - false once the PTY is closed
+     **/
+    bool readPty();
+
+    static constexpr size_t inputSlots = 256;
+
+    int m_pty;
+    int m_wake;
+    VTerm *m_vterm;
+    QMutex *m_lock;
+    SyncUpdate *m_sync;
+    Recorder *m_recorder;
+
+    // Appended to by libvterm with the lock held
+    QByteArray m_output{};
+
+    // Taken from m_output and partially written
+    QByteArray m_outgoing{};
+    int m_outgoingOffset{0};
+
+    // Paste in progress
+    QByteArray m_paste{};
+    int m_pasteOffset{0};
+    std::atomic<bool> m_pasteCancel{false};
+
+    std::atomic<uint64_t> m_queued{0};
+    std::atomic<uint64_t> m_written{0};
+    std::atomic<bool> m_received{false};
+
+    std::array<Input, inputSlots> m_input{};
+    std::atomic<size_t> m_inputHead{0};
+    std::atomic<size_t> m_inputTail{0};
+};
@@ -10,24 +10,57 @@
 #include <QDebug>
 #include <QKeyEvent>
 #include <QPainter>
+#include <QProgressDialog>
 #include <QRegularExpression>
 #include <QScrollBar>
-#include <QSocketNotifier>
+#include <QMutexLocker>
 
 #include <QElapsedTimer>
+#include <QGlyphRun>
+#include <QGuiApplication>
+#include <QRawFont>
+#include <QScreen>
+#include <QTimer>
+#include <QWindow>
 #include <QTextLayout>
 
+#include <algorithm>
+#include <cmath>
 #include <csignal>
+#include <limits>
 
 #include <fcntl.h>
 #include <pty.h>
-#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 
 // #define DEBUG_PAINT_RECT
+// #define DEBUG_PAINT_TIME
 
 namespace {
+// Pastes big enough to show progress for
+const int largePaste = 1 << 20;
+
+// Least milliseconds between frames while jump scrolling
+const int jumpInterval = 100;
+
+// Most milliseconds a synchronized update holds frames back for
+const int syncTimeout = 200;
+
+// Whether a row carries on from the one above it because the line wrapped.
+// Only libvterm 0.2 and later keep track of that, with older ones rows are
+// never joined rather than guessing from how far they reach.
+bool rowContinues(VTermState *vts, int row)
+{
+#if defined(VTERM_VERSION_MAJOR) && (VTERM_VERSION_MAJOR > 0 || VTERM_VERSION_MINOR >= 2)
+    return vterm_state_get_lineinfo(vts, row)->continuation;
+#else
+    Q_UNUSED(vts);
+    Q_UNUSED(row);
+    return false;
+#endif
+}
+
 QDebug operator<<(QDebug dbg, VTermRect rect) __attribute__((unused));
 QDebug operator<<(QDebug dbg, VTermRect rect)
 {
@@ -40,6 +73,18 @@ QDebug operator<<(QDebug dbg, VTermRect rect)
     return dbg.space();
 }
 
+bool colorEqual(const QColor &qc, const VTermColor &vc)
+{
+    return (qc.red() == vc.rgb.red
+            && qc.green() == vc.rgb.green
+            && qc.blue() == vc.rgb.blue);
+}
+
+QColor toQColor(const VTermColor &c)
+{
+    return QColor(qRgb(c.rgb.red, c.rgb.green, c.rgb.blue));
+}
+
 VTermModifier vtermModifier(int mod)
 {
     int ret = VTERM_MOD_NONE;
@@ -117,7 +162,7 @@ QVTerm::QVTerm(QWidget *parent) :
     m_vterm(vterm_new(size().height(), size().width())),
     m_vtermScreen(vterm_obtain_screen(m_vterm)),
     m_highlight(std::make_unique<Highlight>()),
-    m_scrollback(std::make_unique<Scrollback>(5000))
+    m_scrollback(std::make_unique<Scrollback>(1000000, 5000))
 {
     vterm_set_utf8(m_vterm, true);
 
@@ -127,7 +172,10 @@ QVTerm::QVTerm(QWidget *parent) :
             auto p = static_cast<QVTerm*>(user);
             return p->damage(rect);
         },
-        .moverect = nullptr,
+        .moverect = [](VTermRect dest, VTermRect src, void *user) {
+            auto p = static_cast<QVTerm*>(user);
+            return p->moverect(dest, src);
+        },
         .movecursor = [](VTermPos pos, VTermPos oldpos, int visible, void *user) {
             auto p = static_cast<QVTerm*>(user);
             return p->movecursor(pos, oldpos, visible);
@@ -152,12 +200,6 @@ QVTerm::QVTerm(QWidget *parent) :
     vterm_screen_set_damage_merge(m_vtermScreen, VTERM_DAMAGE_SCROLL);
     vterm_screen_enable_altscreen(m_vtermScreen, true);
 
-    static auto on_output = [](const char *s, size_t len, void *user) {
-        auto p = static_cast<QVTerm *>(user);
-        p->m_ptyPending.append(s, static_cast<int>(len));
-    };
-    vterm_output_set_callback(m_vterm, on_output, this);
-
     setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
     setFrameStyle(QFrame::NoFrame);
     setAttribute(Qt::WA_OpaquePaintEvent);
@@ -165,6 +207,11 @@ QVTerm::QVTerm(QWidget *parent) :
     setFont(QFont("Monospace", 8));
     setFocus();
 
+    m_frameTimer = new QTimer(this);
+    m_frameTimer->setSingleShot(true);
+    m_frameTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_frameTimer, &QTimer::timeout, this, &QVTerm::scheduleFrame);
+
     VTermState *vts = vterm_obtain_state(m_vterm);
     vterm_state_set_bold_highbright(vts, true);
 
@@ -220,12 +267,14 @@ QVTerm::QVTerm(QWidget *parent) :
 #endif
 
     vterm_state_set_default_colors(vts, &fg, &bg);
+    m_palette.load(vts);
 
     vterm_screen_reset(m_vtermScreen, 1);
 }
 
 QVTerm::~QVTerm()
 {
+    m_ptyThread.reset();
     vterm_free(m_vterm);
 }
 
@@ -238,70 +287,103 @@ const VTermScreenCell *QVTerm::fetchCell(int x, int y) const
     if (y < 0) {
         // row -1 == m_sb[0], row -2 == m_sb[1]
         size_t sbrow = (y + 1) * -1;
-        if (sbrow >= m_scrollback->size()) {
+        if (m_scrollback->rows(sbrow + 1) <= sbrow) {
             qDebug() << "Scrollback fetch row" << sbrow
-                     << "greater than scrollback size" << m_scrollback->size();
+                     << "greater than scrollback size" << m_scrollback->rows(sbrow + 1);
             return &emptyCell;
         }
 
-        const auto &sbl = m_scrollback->line(sbrow);
-        if (x < sbl.cols()) {
-            return sbl.cell(x);
-        } else {
-            return &emptyCell;
-        }
+        const VTermScreenCell *cell = m_scrollback->rowCell(sbrow, x);
+        return cell ? cell : &emptyCell;
     }
 
-    static VTermScreenCell refCell{};
-    VTermPos vtp{y, x};
-    vterm_screen_get_cell(m_vtermScreen, vtp, &refCell);
-    vterm_screen_convert_color_to_rgb(m_vtermScreen, &refCell.fg);
-    vterm_screen_convert_color_to_rgb(m_vtermScreen, &refCell.bg);
-    return &refCell;
+    if (x < 0 || x >= m_screenSize.width() || y >= m_screenSize.height())
+        return &emptyCell;
+
+    return &m_screen[static_cast<size_t>(y * m_screenSize.width() + x)];
 };
 
+void QVTerm::fetchRows(int start, int end, std::vector<VTermScreenCell> *cells) const
+{
+    VTermScreenCell empty{};
+    empty.width = 1;
+
+    int width = m_vtermSize.width();
+    cells->resize(static_cast<size_t>(std::max(end - start, 0) * width));
+
+    VTermScreenCell *row = cells->data();
+    for (int y = start; y < end; ++y, row += width) {
+        // row -1 == m_sb[0], row -2 == m_sb[1]
+        if (y < 0) {
+            if (!m_scrollback->fetchRow(static_cast<size_t>(-1 - y), width, row))
+                std::fill(row, row + width, empty);
+            continue;
+        }
+
+        int n = y < m_screenSize.height() ? std::min(width, m_screenSize.width()) : 0;
+        if (n > 0)
+            std::copy_n(&m_screen[static_cast<size_t>(y * m_screenSize.width())], n, row);
+        std::fill(row + std::max(n, 0), row + width, empty);
+    }
+}
+
+void QVTerm::snapshotRows(int start, int end, std::vector<VTermScreenCell> *cells) const
+{
+    QMutexLocker lock(start < 0 ? &m_lock : nullptr);
+    fetchRows(start, end, cells);
+}
+
 void QVTerm::match(const QRegularExpression *regexp)
 {
-    if (!m_matches.empty()) {
+    if (m_search && m_search->regexp() == *regexp) {
         matchNext();
         return;
     }
-    int width = m_vtermSize.width();
-    int height = m_vtermSize.height();
-    QString dump = Region({0, 0}, {width, height}).dump(m_vtermSize, [this](int x, int y) {
-        return fetchCell(x, y);
-    });
 
-    m_matches.clear();
-    auto matchIter = regexp->globalMatch(dump);
-    while (matchIter.isValid() && matchIter.hasNext()) {
-        auto match = matchIter.next();
-        int capturedEnd = match.capturedEnd() - 1;
-
-        int yStart = match.capturedStart() / width;
-        int yEnd = capturedEnd / width;
-        int xStart = match.capturedStart() % width;
-        int xEnd = capturedEnd % width;
-        m_matches.emplace_back(QPoint{xStart, yStart}, QPoint{xEnd, yEnd});
-    }
-    m_match = m_matches.crbegin();
-
-    if (m_match != m_matches.crend()) {
-        auto *cb = QApplication::clipboard();
-        QString matched = m_match->dumpString(m_vtermSize, [this](int x, int y) {
-            return fetchCell(x, y);
-        });
-        cb->setText(matched, QClipboard::Selection);
-        viewport()->update(m_match->pixelRect(m_vtermSize, m_cellSize));
-    }
+    matchClear();
+
+    // The screen has to be in step with the scrollback for match positions to
+    // line up
+    flushFrame();
+    QMutexLocker lock(&m_lock);
+    syncScreen();
+
+    // The scrollback isn't shown on the altscreen, so don't look there
+    m_search = std::make_unique<Search>(
+            *regexp,
+            [this](int start, int end, std::vector<VTermScreenCell> *cells) {
+                fetchRows(start, end, cells);
+            },
+            m_vtermSize,
+            m_continuedRows,
+            m_altscreen ? nullptr : m_scrollback.get());
+    connect(m_search.get(), &Search::matched, m_search.get(), [this](QVector<SearchMatch> matches) {
+        bool first = m_matches.empty();
+        m_matches.insert(m_matches.end(), matches.begin(), matches.end());
+        if (first)
+            showMatch();
+    });
+    m_search->start(QThread::LowPriority);
 }
 
 void QVTerm::matchClear()
 {
-    if (m_match != m_matches.crend())
-        viewport()->update(m_match->pixelRect(m_vtermSize, m_cellSize));
+    // Let a running search wind down on its own rather than waiting for it,
+    // it doesn't touch the terminal once started.
+    if (m_search) {
+        Search *search = m_search.release();
+        search->disconnect();
+        connect(search, &QThread::finished, search, &QObject::deleteLater);
+        search->requestInterruption();
+        if (search->isFinished())
+            delete search;
+    }
+
+    if (!m_matchRegion.isNull())
+        viewport()->update(matchRect());
     m_matches.clear();
-    m_match = m_matches.crend();
+    m_match = 0;
+    m_matchRegion = Region();
 }
 
 void QVTerm::matchNext()
@@ -309,20 +391,104 @@ void QVTerm::matchNext()
     if (m_matches.empty())
         return;
 
-    viewport()->update(m_match->pixelRect(m_vtermSize, m_cellSize));
-    m_match++;
+    if (!m_matchRegion.isNull())
+        viewport()->update(matchRect());
+    m_match = (m_match + 1) % m_matches.size();
+    showMatch();
+}
 
-    if (m_match == m_matches.crend())
-        m_match = m_matches.crbegin();
+bool QVTerm::record(const QString &path)
+{
+    auto recorder = std::make_unique<Recorder>();
+    if (!recorder->open(path))
+        return false;
+
+    QMutexLocker lock(&m_lock);
+    recorder->resize(m_vtermSize.height(), m_vtermSize.width());
+    m_recorder = std::move(recorder);
+    return true;
+}
 
-    if (m_match != m_matches.crend()) {
-        auto *cb = QApplication::clipboard();
-        QString matched = m_match->dumpString(m_vtermSize, [this](int x, int y) {
-            return fetchCell(x, y);
-        });
-        cb->setText(matched, QClipboard::Selection);
-        viewport()->update(m_match->pixelRect(m_vtermSize, m_cellSize));
+bool QVTerm::replay(const QString &path, bool realtime)
+{
+    auto recording = std::make_unique<Recording>();
+    if (!recording->open(path))
+        return false;
+
+    m_replay = std::move(recording);
+    m_replayPending = false;
+    m_replayRealtime = realtime;
+    m_replayDue = 0;
+    m_replayStats = {};
+
+    // Nobody is listening to what the terminal answers
+    vterm_output_set_callback(
+            m_vterm, [](const char *, size_t, void *) {}, nullptr);
+
+    m_replayTimer = new QTimer(this);
+    m_replayTimer->setSingleShot(true);
+    m_replayTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_replayTimer, &QTimer::timeout, this, &QVTerm::replayStep);
+    m_replayTimer->start(0);
+    m_replayClock.start();
+    return true;
+}
+
+void QVTerm::replayStep()
+{
+    QElapsedTimer slice;
+    slice.start();
+
+    while (true) {
+        if (!m_replayPending) {
+            if (!m_replay->next(&m_replayEvent))
+                break;
+            m_replayPending = true;
+            m_replayDue += static_cast<qint64>(m_replayEvent.delay);
+        }
+
+        // Give frames a chance to be painted in between
+        if (slice.elapsed() >= frameInterval()) {
+            m_replayTimer->start(0);
+            return;
+        }
+
+        if (m_replayRealtime) {
+            qint64 wait = m_replayDue - m_replayClock.nsecsElapsed() / 1000;
+            if (wait > 0) {
+                m_replayTimer->start(static_cast<int>((wait + 999) / 1000));
+                return;
+            }
+        }
+
+        m_replayPending = false;
+        if (m_replayEvent.type == RecordedEvent::Resize) {
+            resizeTerminal({m_replayEvent.cols, m_replayEvent.rows});
+            continue;
+        }
+
+        QElapsedTimer parse;
+        parse.start();
+        {
+            QMutexLocker lock(&m_lock);
+            // Nobody is listening to the answers, same as for libvterm
+            m_sync.write(
+                    m_vterm,
+                    m_replayEvent.data.constData(),
+                    static_cast<size_t>(m_replayEvent.data.size()),
+                    [](const char *, size_t) {});
+        }
+        m_replayStats.parseNs += parse.nsecsElapsed();
+        m_replayStats.bytes += static_cast<uint64_t>(m_replayEvent.data.size());
+        scheduleFrame();
     }
+
+    // Paint the final state before reporting
+    m_frameTimer->stop();
+    flushFrame();
+    viewport()->repaint();
+    m_replay.reset();
+    emit replayFinished();
 }
 
 void QVTerm::scrollPage(int pages)
@@ -331,17 +497,60 @@ void QVTerm::scrollPage(int pages)
     scrollContentsBy(0, delta);
 }
 
+ScrollbackUsage QVTerm::scrollbackUsage() const
+{
+    QMutexLocker lock(&m_lock);
+    return m_scrollback->usage();
+}
+
+uint64_t QVTerm::scrollbarUpdatesSaved() const
+{
+    // Every line used to set both the range and the value
+    return 2 * m_scrollbarLines - m_scrollbarUpdates;
+}
+
 void QVTerm::setFont(const QFont &font)
 {
     m_font = font;
     QFontMetrics qfm{m_font};
     m_cellSize = {qfm.averageCharWidth(), qfm.ascent() + qfm.descent()};
     m_cellBaseline = qfm.ascent();
+    m_glyphs.setFont(m_font, logicalDpiY());
     QAbstractScrollArea::setFont(m_font);
     m_vtermSize = {
             size().width() / m_cellSize.width(),
             size().height() / m_cellSize.height(),
     };
+    m_rowCache.reset(m_vtermSize.height());
+
+    QMutexLocker lock(&m_lock);
+    m_scrollback->setWidth(m_vtermSize.width());
+}
+
+void QVTerm::setScrollbackBudget(size_t bytes)
+{
+    size_t size;
+    {
+        QMutexLocker lock(&m_lock);
+        m_scrollback->setBudget(bytes);
+        size = m_scrollback->size();
+    }
+    verticalScrollBar()->setRange(0, static_cast<int>(size));
+}
+
+bool QVTerm::spillScrollback(size_t window, size_t capacity)
+{
+    size_t size;
+    {
+        QMutexLocker lock(&m_lock);
+        if (!m_scrollback->spill(window))
+            return false;
+
+        m_scrollback->setCapacity(capacity);
+        size = m_scrollback->size();
+    }
+    verticalScrollBar()->setRange(0, static_cast<int>(size));
+    return true;
 }
 
 void QVTerm::start()
@@ -391,18 +600,32 @@ void QVTerm::start()
         execvp(shell, args);
     }
     fcntl(m_pty, F_SETFL, fcntl(m_pty, F_GETFL) | O_NONBLOCK);
-    m_ptysn = new QSocketNotifier(m_pty, QSocketNotifier::Read, this);
-    connect(m_ptysn, &QSocketNotifier::activated, [this](int fd) {
-        onPtyInput(fd);
+    m_ptyThread = std::make_unique<PtyThread>(m_pty, m_vterm, &m_lock, &m_sync, m_recorder.get());
+    connect(m_ptyThread.get(), &PtyThread::received, this, [this]() {
+        m_ptyThread->acknowledge();
+        scheduleFrame();
     });
+    connect(m_ptyThread.get(), &PtyThread::closed, this, []() {
+        QCoreApplication::exit();
+    });
+    connect(m_ptyThread.get(), &PtyThread::pasteProgress, this, [this](qint64 done, qint64 total) {
+        if (m_pasteProgress)
+            m_pasteProgress->setValue(static_cast<int>(done * 1000 / total));
+    });
+    connect(m_ptyThread.get(), &PtyThread::pasteFinished, this, [this]() {
+        if (m_pasteProgress) {
+            m_pasteProgress->deleteLater();
+            m_pasteProgress = nullptr;
+        }
+    });
+    m_ptyThread->start();
 }
 
 void QVTerm::focusInEvent(QFocusEvent *event)
 {
     event->accept();
 
-    VTermState *state = vterm_obtain_state(m_vterm);
-    vterm_state_focus_in(state);
+    sendInput({PtyThread::Input::FocusIn});
     repaintCursor();
 }
 
@@ -410,8 +633,7 @@ void QVTerm::focusOutEvent(QFocusEvent *event)
 {
     event->accept();
 
-    VTermState *state = vterm_obtain_state(m_vterm);
-    vterm_state_focus_out(state);
+    sendInput({PtyThread::Input::FocusOut});
     repaintCursor();
 }
 
@@ -433,7 +655,7 @@ void QVTerm::keyPressEvent(QKeyEvent *event)
                 && (key == VTERM_KEY_ESCAPE || key == VTERM_KEY_BACKSPACE))
             mod = VTERM_MOD_NONE;
 
-        vterm_keyboard_key(m_vterm, key, mod);
+        sendInput({PtyThread::Input::Key, key, 0, mod});
     } else if (event->text().length()) {
         // This maps to delete word and is way to easy to mistakenly type
         if (event->key() == Qt::Key_Space && mod == VTERM_MOD_SHIFT)
@@ -444,18 +666,17 @@ void QVTerm::keyPressEvent(QKeyEvent *event)
         // ctrl modifier.  This helps with ncurses applications which otherwise
         // do not recognize ctrl+<key> and in the shell for getting common control characters
         // like ctrl+i for tab or ctrl+j for newline.
-        vterm_keyboard_unichar(
-                m_vterm,
+        sendInput({
+                PtyThread::Input::Char,
+                VTERM_KEY_NONE,
                 event->text().toUcs4()[0],
-                static_cast<VTermModifier>(mod & ~VTERM_MOD_CTRL));
+                static_cast<VTermModifier>(mod & ~VTERM_MOD_CTRL)});
     }
 
     if (mod == VTERM_MOD_NONE && !m_altscreen && m_scrollback->offset()) {
         m_scrollback->unscroll();
         viewport()->update();
     }
-
-    flushToPty();
 }
 
 void QVTerm::mouseMoveEvent(QMouseEvent *event)
@@ -464,10 +685,11 @@ void QVTerm::mouseMoveEvent(QMouseEvent *event)
     if (!QRect(QPoint(), size()).contains(event->pos()))
         return;
 
+    Region before = m_highlight->active() ? m_highlight->region() : Region();
     m_highlight->update(
             event->pos().x() / m_cellSize.width(),
             (event->pos().y() / m_cellSize.height()) - static_cast<int>(m_scrollback->offset()));
-    viewport()->update();
+    updateHighlight(before);
 }
 
 void QVTerm::mousePressEvent(QMouseEvent *event)
@@ -480,10 +702,11 @@ void QVTerm::mousePressEvent(QMouseEvent *event)
 
     if (event->button() == Qt::LeftButton) {
         event->accept();
+        Region before = m_highlight->active() ? m_highlight->region() : Region();
         m_highlight->anchor(
                 event->pos().x() / m_cellSize.width(),
                 (event->pos().y() / m_cellSize.height()) - static_cast<int>(m_scrollback->offset()));
-        viewport()->update();
+        updateHighlight(before);
     }
 }
 
@@ -499,132 +722,52 @@ void QVTerm::paintEvent(QPaintEvent *event)
 {
     event->accept();
 
-    //    QElapsedTimer timer;
-    //    timer.start();
+    QElapsedTimer timer;
+    timer.start();
     QPainter p(viewport());
     p.setCompositionMode(QPainter::CompositionMode_Source);
 
-    static auto colorEqual = [](const QColor &qc, const VTermColor &vc) {
-        return (qc.red() == vc.rgb.red
-                && qc.green() == vc.rgb.green
-                && qc.blue() == vc.rgb.blue);
-    };
-
-    static auto toQColor = [](const VTermColor &c) -> QColor {
-        return QColor(qRgb(c.rgb.red, c.rgb.green, c.rgb.blue));
-    };
-
-    VTermColor defaultBg;
-    if (!m_altscreen) {
-        VTermColor defaultFg;
-        vterm_state_get_default_colors(vterm_obtain_state(m_vterm), &defaultFg, &defaultBg);
-        // We want to compare the cell bg against this later and cells don't
-        // set DEFAULT_BG
-        defaultBg.type = VTERM_COLOR_RGB;
-    } else {
+    // Resolved the same way as the cells it's compared against
+    VTermColor defaultBg = m_palette.defaultBg();
+    if (m_altscreen) {
         // This is a slightly better guess when in an altscreen
         const VTermScreenCell *cell = fetchCell(0, 0);
         defaultBg = cell->bg;
     }
 
-    QFont fnt{m_font};
     p.fillRect(event->rect(), toQColor(defaultBg));
 
-    QString buf{};
-    QVector<QPointF> positions{};
-
-    auto paintBuffer = [&p, &fnt, &buf, &positions]() {
-        if (buf.isEmpty())
-            return;
-
-        static QPointF origin{0, 0};
-        auto rawFont = QRawFont::fromFont(fnt);
-
-        QGlyphRun run{};
-        run.setRawFont(rawFont);
-        run.setGlyphIndexes(rawFont.glyphIndexesForString(buf));
-        run.setPositions(positions);
-        p.drawGlyphRun(origin, run);
+    // The raw fonts depend on the DPI, which changes when moving screens
+    if (m_glyphs.dpi() != logicalDpiY())
+        m_glyphs.setFont(m_font, logicalDpiY());
 
-        buf.clear();
-        positions.clear();
-    };
+    // Remembered row hashes were taken with the old background
+    if (!vterm_color_is_equal(&defaultBg, &m_rowBg)) {
+        m_rowCache.invalidate(0, m_vtermSize.height());
+        m_rowBg = defaultBg;
+    }
 
-    int startCol = event->rect().x() / m_cellSize.width();
-    int endCol = startCol + event->rect().width() / m_cellSize.width();
     int startRow = event->rect().y() / m_cellSize.height();
     int endRow = startRow + event->rect().height() / m_cellSize.height();
 
 #ifdef DEBUG_PAINT_RECT
     qDebug()
             << event->rect()
-            << "sc:" << startCol
-            << "ec:" << endCol
             << "sr:" << startRow
             << "er:" << endRow
             << "\n";
 #endif
 
+    // Rows from the scrollback are shared with the PTY thread
+    QMutexLocker lock(m_scrollback->offset() ? &m_lock : nullptr);
+
+    // Rows are painted whole, the painter clips them to the damaged area
     for (int row = startRow; row < endRow; row++) {
         int phyrow = row - static_cast<int>(m_scrollback->offset());
-
-        for (int col = startCol; col < endCol; ++col) {
-            const VTermScreenCell *cell = fetchCell(col, phyrow);
-            const VTermColor *bg = &cell->bg;
-            const VTermColor *fg = &cell->fg;
-            bool highlight = (m_highlight->contains(col, phyrow)
-                    || (m_match != m_matches.crend() && m_match->contains(col, phyrow)));
-
-            if (static_cast<bool>(cell->attrs.reverse) || highlight) {
-                bg = &cell->fg;
-                fg = &cell->bg;
-            }
-
-            if (!vterm_color_is_equal(bg, &defaultBg)) {
-                p.fillRect(
-                        pixelRect(col, row, cell->width, 1),
-                        toQColor(*bg));
-            }
-
-            if (!cell->chars[0])
-                continue;
-
-            if (!colorEqual(p.pen().color(), *fg)) {
-                paintBuffer();
-                p.setPen(toQColor(*fg));
-            }
-
-            if (false) {
-                if (static_cast<bool>(cell->attrs.bold) != fnt.bold()) {
-                    paintBuffer();
-                    fnt.setBold(static_cast<bool>(cell->attrs.bold));
-                }
-            }
-
-            if (static_cast<bool>(cell->attrs.underline) != fnt.underline()) {
-                paintBuffer();
-                fnt.setUnderline(static_cast<bool>(cell->attrs.underline));
-            }
-
-            if (static_cast<bool>(cell->attrs.italic) != fnt.italic()) {
-                paintBuffer();
-                fnt.setItalic(static_cast<bool>(cell->attrs.italic));
-            }
-
-            // No blink.
-
-            if (static_cast<bool>(cell->attrs.strike) != fnt.strikeOut()) {
-                paintBuffer();
-                fnt.setStrikeOut(static_cast<bool>(cell->attrs.strike));
-            }
-
-            buf.append(QString::fromUcs4(cell->chars, cell->width));
-
-            positions.append({static_cast<qreal>(pixelCol(col)),
-                    static_cast<qreal>(pixelRow(row) + m_cellBaseline)});
-        }
-        paintBuffer();
+        p.drawPixmap(0, pixelRow(row), *rowImage(phyrow, defaultBg));
+        paintHighlights(p, row, phyrow, defaultBg);
     }
+    lock.unlock();
 
     if (hasFocus()
             && m_cursor.visible
@@ -641,13 +784,33 @@ void QVTerm::paintEvent(QPaintEvent *event)
         }
     }
 
-    //qDebug() << "repaint took" << timer.elapsed() << "ms";
+    if (m_replay) {
+        qint64 ns = timer.nsecsElapsed();
+        m_replayStats.paintNs += ns;
+        m_replayStats.paints.push_back(ns);
+        ++m_replayStats.frames;
+    }
+#ifdef DEBUG_PAINT_TIME
+    qDebug() << "repaint of" << event->rect() << "took" << timer.nsecsElapsed() / 1000 << "us";
+#endif
 }
 
 void QVTerm::resizeEvent(QResizeEvent *event)
 {
     event->accept();
 
+    // Replays keep the sizes they were recorded with
+    if (m_replay)
+        return;
+
+    resizeTerminal({
+            size().width() / m_cellSize.width(),
+            size().height() / m_cellSize.height(),
+    });
+}
+
+void QVTerm::resizeTerminal(QSize size)
+{
     // If increasing in size, we'll trigger libvterm to call sb_popline in
     // order to pull lines out of the history.  This will cause the scrollback
     // to decrease in size which reduces the size of the verticalScrollBar.
@@ -655,19 +818,27 @@ void QVTerm::resizeEvent(QResizeEvent *event)
     m_ignoreScroll = true;
 
     m_highlight->reset();
-    m_vtermSize = {
-            size().width() / m_cellSize.width(),
-            size().height() / m_cellSize.height(),
-    };
-    struct winsize wsz = {
-            .ws_row = static_cast<short unsigned int>(m_vtermSize.height()),
-            .ws_col = static_cast<short unsigned int>(m_vtermSize.width()),
-            .ws_xpixel = 0,
-            .ws_ypixel = 0,
-    };
-    ioctl(m_pty, TIOCSWINSZ, &wsz);
-    vterm_set_size(m_vterm, m_vtermSize.height(), m_vtermSize.width());
-    vterm_screen_flush_damage(m_vtermScreen);
+    m_vtermSize = size;
+    if (m_pty >= 0) {
+        struct winsize wsz = {
+                .ws_row = static_cast<short unsigned int>(m_vtermSize.height()),
+                .ws_col = static_cast<short unsigned int>(m_vtermSize.width()),
+                .ws_xpixel = 0,
+                .ws_ypixel = 0,
+        };
+        ioctl(m_pty, TIOCSWINSZ, &wsz);
+    }
+    m_rowCache.reset(m_vtermSize.height());
+    {
+        QMutexLocker lock(&m_lock);
+        if (m_recorder)
+            m_recorder->resize(m_vtermSize.height(), m_vtermSize.width());
+        vterm_set_size(m_vterm, m_vtermSize.height(), m_vtermSize.width());
+
+        // History is rewrapped lazily as it comes into view
+        m_scrollback->setWidth(m_vtermSize.width());
+    }
+    flushFrame();
     m_ignoreScroll = false;
 }
 
@@ -690,7 +861,11 @@ void QVTerm::scrollContentsBy(int dx, int dy)
         return;
 
     size_t orig = m_scrollback->offset();
-    size_t offset = m_scrollback->scroll(dy);
+    size_t offset;
+    {
+        QMutexLocker lock(&m_lock);
+        offset = m_scrollback->scroll(dy);
+    }
     if (orig == offset)
         return;
 
@@ -699,19 +874,151 @@ void QVTerm::scrollContentsBy(int dx, int dy)
 }
 
 int QVTerm::damage(VTermRect rect)
+{
+    if (m_frame.jump)
+        return 1;
+
+    m_frame.changes.push_back({rect, rect, false});
+    for (int row = std::max(rect.start_row, 0); row < rect.end_row && row < static_cast<int>(m_dirtyRows.size()); ++row)
+        m_dirtyRows[static_cast<size_t>(row)] = true;
+    return 1;
+}
+
+int QVTerm::moverect(VTermRect dest, VTermRect src)
+{
+    if (m_frame.jump)
+        return 1;
+
+    // Only the end result of scrolling through more than a screenful is worth
+    // painting, drop the changes and repaint everything
+    // The size is asked of libvterm, m_vtermSize belongs to the GUI thread
+    // and m_dirtyRows is empty until the first frame
+    int rows = 0;
+    int cols = 0;
+    vterm_get_size(m_vterm, &rows, &cols);
+    m_frame.scrolled += std::abs(dest.start_row - src.start_row);
+    if (m_frame.scrolled >= rows) {
+        m_frame.jump = true;
+        m_frame.changes.clear();
+        m_frame.changes.shrink_to_fit();
+        std::fill(m_dirtyRows.begin(), m_dirtyRows.end(), true);
+        return 1;
+    }
+
+    m_frame.changes.push_back({dest, src, true});
+    for (int row = std::max(dest.start_row, 0); row < dest.end_row && row < static_cast<int>(m_dirtyRows.size()); ++row)
+        m_dirtyRows[static_cast<size_t>(row)] = true;
+    return 1;
+}
+
+int QVTerm::movecursor(VTermPos pos, VTermPos oldpos, int visible)
+{
+    Q_UNUSED(oldpos);
+
+    m_frame.cursorMoved = true;
+    m_frame.cursor = pos;
+    m_frame.cursorVisible = visible;
+    return 1;
+}
+
+int QVTerm::settermprop(VTermProp prop, VTermValue *val)
+{
+    Prop copy{prop, false, 0, {}};
+    switch (vterm_get_prop_type(prop)) {
+        case VTERM_VALUETYPE_BOOL:
+            copy.boolean = val->boolean;
+            break;
+        case VTERM_VALUETYPE_INT:
+            copy.number = val->number;
+            break;
+        case VTERM_VALUETYPE_STRING:
+            copy.string = val->string;
+            break;
+        default:
+            break;
+    }
+    m_frame.props.push_back(std::move(copy));
+    return 1;
+}
+
+int QVTerm::sb_pushline(int cols, const VTermScreenCell *cells)
+{
+    // libvterm scrolls its line info before pushing the top row, so the row
+    // now on top tells whether the pushed one wrapped into it
+    m_scrollback->emplace(cols, cells, m_palette, rowContinues(vterm_obtain_state(m_vterm), 0));
+    ++m_frame.scrollback;
+
+    return 1;
+}
+
+int QVTerm::sb_popline(int cols, VTermScreenCell *cells)
+{
+    if (m_scrollback->size() == 0)
+        return 0;
+
+    m_scrollback->popto(cols, cells);
+    ++m_frame.scrollback;
+
+    return 1;
+}
+
+void QVTerm::applyDamage(VTermRect rect)
 {
     viewport()->update(pixelRect(rect));
+    m_rowCache.invalidate(rect.start_row, rect.end_row);
 
     Region damRegion{rect};
-    if (m_highlight->region().overlaps(damRegion))
+    if (m_highlight->region().overlaps(damRegion)) {
+        Region before = m_highlight->region();
         m_highlight->reset();
-    matchClear();
+        updateHighlight(before);
+    }
+}
 
-    return 1;
+void QVTerm::applyMove(VTermRect dest, VTermRect src)
+{
+    VTermRect area{
+            std::min(dest.start_row, src.start_row),
+            std::max(dest.end_row, src.end_row),
+            std::min(dest.start_col, src.start_col),
+            std::max(dest.end_col, src.end_col),
+    };
+    QRect pixels = pixelRect(
+            area.start_col,
+            area.start_row,
+            area.end_col - area.start_col,
+            area.end_row - area.start_row);
+
+    m_rowCache.invalidate(area.start_row, area.end_row);
+
+    bool highlighted = m_highlight->region().overlaps(Region{area});
+    if (highlighted)
+        m_highlight->reset();
+    bool matched = !m_matchRegion.isNull();
+
+    // Selections and matches don't move with the text, and the screen isn't
+    // where it used to be when scrolled back, so repaint all of it instead
+    if (highlighted || matched || m_scrollback->offset()) {
+        viewport()->update(pixels);
+        return;
+    }
+
+    // Copy what's already painted, Qt repaints the rows that are exposed
+    int dx = dest.start_col - src.start_col;
+    int dy = dest.start_row - src.start_row;
+    viewport()->scroll(pixelCol(dx), pixelRow(dy), pixels);
+
+    // The cursor was painted into the pixels that just moved
+    if (m_cursor.row >= src.start_row && m_cursor.row < src.end_row
+            && m_cursor.col >= src.start_col && m_cursor.col < src.end_col) {
+        viewport()->update(pixelRect(m_cursor.col + dx, m_cursor.row + dy, 1, 1));
+        repaintCursor();
+    }
 }
 
-int QVTerm::movecursor(VTermPos pos, VTermPos oldpos, int visible)
+void QVTerm::applyCursor(VTermPos pos, bool visible)
 {
+    VTermPos oldpos{m_cursor.row, m_cursor.col};
     if (pos.row == oldpos.row) {
         viewport()->update(pixelRect(
                 std::min(pos.col, oldpos.col),
@@ -725,154 +1032,495 @@ int QVTerm::movecursor(VTermPos pos, VTermPos oldpos, int visible)
     m_cursor.row = pos.row;
     m_cursor.col = pos.col;
     m_cursor.visible = visible;
-    return 1;
 }
 
-int QVTerm::settermprop(VTermProp prop, VTermValue *val)
+void QVTerm::applyProp(const Prop &prop)
 {
-    switch (prop) {
+    switch (prop.prop) {
         case VTERM_PROP_CURSORVISIBLE:
-            m_cursor.visible = val->boolean;
+            m_cursor.visible = prop.boolean;
             break;
         case VTERM_PROP_CURSORBLINK:
-            qDebug() << "Ignoring VTERM_PROP_CURSORBLINK" << val->boolean;
+            qDebug() << "Ignoring VTERM_PROP_CURSORBLINK" << prop.boolean;
             break;
         case VTERM_PROP_CURSORSHAPE:
-            qDebug() << "Ignoring VTERM_PROP_CURSORSHAPE" << val->number;
+            qDebug() << "Ignoring VTERM_PROP_CURSORSHAPE" << prop.number;
             break;
         case VTERM_PROP_ICONNAME:
-            emit iconTextChanged(val->string);
+            emit iconTextChanged(prop.string);
             break;
         case VTERM_PROP_TITLE:
-            emit titleChanged(val->string);
+            emit titleChanged(prop.string);
             break;
         case VTERM_PROP_ALTSCREEN:
-            m_altscreen = val->boolean;
-            m_matches.clear();
+            m_altscreen = prop.boolean;
+            matchClear();
             m_highlight->reset();
             break;
         case VTERM_PROP_MOUSE:
-            qDebug() << "Ignoring VTERM_PROP_MOUSE" << val->number;
+            qDebug() << "Ignoring VTERM_PROP_MOUSE" << prop.number;
             break;
         case VTERM_PROP_REVERSE:
-            qDebug() << "Ignoring VTERM_PROP_REVERSE" << val->boolean;
+            qDebug() << "Ignoring VTERM_PROP_REVERSE" << prop.boolean;
             break;
         case VTERM_N_PROPS:
             break;
     }
-    return 1;
 }
 
-int QVTerm::sb_pushline(int cols, const VTermScreenCell *cells)
+void QVTerm::copyToClipboard()
 {
-    m_scrollback->emplace(cols, cells, vterm_obtain_state(m_vterm));
-    verticalScrollBar()->setRange(0, static_cast<int>(m_scrollback->size()));
-    verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+    if (!m_highlight->active())
+        return;
 
-    return 1;
+    QMutexLocker lock(&m_lock);
+    QString buf = m_highlight->region().dumpString(m_vtermSize, [this](int start, int end, std::vector<VTermScreenCell> *cells) {
+        fetchRows(start, end, cells);
+    });
+    lock.unlock();
+    auto *cb = QApplication::clipboard();
+    cb->setText(buf, QClipboard::Selection);
 }
 
-int QVTerm::sb_popline(int cols, VTermScreenCell *cells)
+void QVTerm::flushFrame()
 {
-    if (m_scrollback->size() == 0)
-        return 0;
+    m_lastFrame.start();
+
+    Frame frame;
+    size_t scrollbackSize;
+    {
+        QMutexLocker lock(&m_lock);
+        syncScreen();
+        std::swap(frame, m_frame);
+        scrollbackSize = m_scrollback->size();
+        if (m_replay && m_sync.active())
+            ++m_replayStats.tornFrames;
+    }
 
-    m_scrollback->popto(cols, cells);
+    m_jumping = frame.jump;
+    if (frame.jump)
+        applyDamage({0, m_vtermSize.height(), 0, m_vtermSize.width()});
+
+    for (const auto &change : frame.changes) {
+        if (change.move)
+            applyMove(change.dest, change.src);
+        else
+            applyDamage(change.dest);
+    }
 
-    verticalScrollBar()->setRange(0, static_cast<int>(m_scrollback->size()));
-    verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+    // Matches are kept by line, so they stay with the text as it scrolls
+    if (frame.scrollback && !m_matches.empty()) {
+        if (!m_matchRegion.isNull())
+            viewport()->update(matchRect());
+        if (placeMatch())
+            viewport()->update(matchRect());
+    }
 
-    return 1;
+    if (frame.cursorMoved)
+        applyCursor(frame.cursor, frame.cursorVisible);
+
+    for (const auto &prop : frame.props)
+        applyProp(prop);
+
+    // Each setRange() and setValue() emits signals and may scroll, so only
+    // make the calls that change anything
+    if (frame.scrollback) {
+        QScrollBar *bar = verticalScrollBar();
+        m_scrollbarLines += frame.scrollback;
+        if (bar->maximum() != static_cast<int>(scrollbackSize)) {
+            bar->setRange(0, static_cast<int>(scrollbackSize));
+            ++m_scrollbarUpdates;
+        }
+        if (bar->value() != bar->maximum()) {
+            bar->setValue(bar->maximum());
+            ++m_scrollbarUpdates;
+        }
+    }
 }
 
-void QVTerm::copyToClipboard()
+int QVTerm::frameInterval() const
 {
-    if (!m_highlight->active())
+    QWindow *window = this->window()->windowHandle();
+    QScreen *screen = window ? window->screen() : QGuiApplication::primaryScreen();
+    qreal rate = screen && screen->refreshRate() > 0 ? screen->refreshRate() : 60;
+    return std::max(1, qRound(1000 / rate));
+}
+
+void QVTerm::scheduleFrame()
+{
+    // Half drawn updates aren't shown, unless the app takes too long to
+    // finish them
+    int hold = m_sync.holdFor(syncTimeout);
+    if (hold) {
+        if (!m_syncHeld || !m_frameTimer->isActive())
+            m_frameTimer->start(hold);
+        m_syncHeld = true;
         return;
+    }
 
-    QString buf = m_highlight->region().dumpString(m_vtermSize, [this](int x, int y) {
-        return fetchCell(x, y);
-    });
+    // Once the update is complete, the frame is due when it would have been
+    // without it
+    if (m_syncHeld) {
+        m_syncHeld = false;
+        m_frameTimer->stop();
+    }
+
+    if (m_frameTimer->isActive())
+        return;
+
+    // Output after a quiet spell, like echoing a key, is shown right away.
+    // Anything following it within the same frame waits for the next one.
+    // A flood is only shown now and then, its final state is still painted
+    // once it stops.
+    qint64 interval = m_jumping ? std::max(frameInterval(), jumpInterval) : frameInterval();
+    qint64 elapsed = m_lastFrame.isValid() ? m_lastFrame.elapsed() : interval;
+    if (elapsed >= interval) {
+        flushFrame();
+        return;
+    }
+    m_frameTimer->start(static_cast<int>(interval - elapsed));
+}
+
+void QVTerm::pasteFromClipboard()
+{
     auto *cb = QApplication::clipboard();
-    cb->setText(buf, QClipboard::Selection);
+    QByteArray text = cb->text(QClipboard::Selection).toUtf8();
+
+    // Don't let the paste end the bracketed paste early
+    text.replace("\x1b[201~", "");
+    if (text.isEmpty() || m_pasteProgress)
+        return;
+
+    if (text.size() >= largePaste) {
+        m_pasteProgress = new QProgressDialog(tr("Pasting..."), tr("Cancel"), 0, 1000, this);
+        m_pasteProgress->setWindowModality(Qt::WindowModal);
+        m_pasteProgress->setMinimumDuration(500);
+        m_pasteProgress->setAutoClose(false);
+        m_pasteProgress->setAutoReset(false);
+        connect(m_pasteProgress, &QProgressDialog::canceled, this, [this]() {
+            m_ptyThread->cancelPaste();
+        });
+        m_pasteProgress->setValue(0);
+    }
+
+    sendInput({PtyThread::Input::Paste, VTERM_KEY_NONE, 0, VTERM_MOD_NONE, std::move(text)});
+
+    if (!m_altscreen && m_scrollback->offset()) {
+        m_scrollback->unscroll();
+        viewport()->update();
+    }
 }
 
-void QVTerm::flushToPty()
+void QVTerm::sendInput(PtyThread::Input input)
 {
-    if (!m_ptyPending.isEmpty()) {
-        ssize_t written = 0;
-        while (written < m_ptyPending.size()) {
-            ssize_t n = write(m_pty, m_ptyPending.data(), m_ptyPending.size());
-            if (n < 0) {
-                int e = errno;
-                if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR) {
-                    continue;
-                }
+    if (!m_ptyThread)
+        return;
 
-                // Give up or bail?
-                qCritical("write to pty: %s", strerror(e));
-                break;
-            }
+    if (!m_ptyThread->send(std::move(input)))
+        qWarning("Dropping input, the terminal isn't keeping up");
+}
 
-            written += n;
-        }
+void QVTerm::syncScreen()
+{
+    vterm_screen_flush_damage(m_vtermScreen);
+    m_screenLine = m_scrollback->serial();
+
+    int rows = 0;
+    int cols = 0;
+    vterm_get_size(m_vterm, &rows, &cols);
+    if (m_screenSize != QSize(cols, rows)) {
+        m_screenSize = {cols, rows};
+        m_screen.assign(static_cast<size_t>(rows * cols), VTermScreenCell{});
+        m_dirtyRows.assign(static_cast<size_t>(rows), true);
+    }
 
-        m_ptyPending.clear();
+    VTermState *vts = vterm_obtain_state(m_vterm);
+    m_continuedRows.resize(static_cast<size_t>(rows));
+    for (int y = 0; y < rows; ++y)
+        m_continuedRows[static_cast<size_t>(y)] = rowContinues(vts, y);
+
+    for (int y = 0; y < rows; ++y) {
+        if (!m_dirtyRows[static_cast<size_t>(y)])
+            continue;
+
+        m_dirtyRows[static_cast<size_t>(y)] = false;
+        for (int x = 0; x < cols; ++x) {
+            VTermScreenCell *cell = &m_screen[static_cast<size_t>(y * cols + x)];
+            vterm_screen_get_cell(m_vtermScreen, {y, x}, cell);
+            m_palette.resolve(&cell->fg);
+            m_palette.resolve(&cell->bg);
+        }
     }
 }
 
-void QVTerm::onPtyInput(int fd)
+void QVTerm::rowKey(const VTermScreenCell *cells, const VTermColor &defaultBg, RowKey *key) const
 {
-    auto now = []() -> qint64 {
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        return ((qint64)tv.tv_sec) * 1000000UL + tv.tv_usec;
+    static auto rgb = [](const VTermColor &c) -> uint64_t {
+        return static_cast<uint64_t>(c.rgb.red) << 16 | c.rgb.green << 8 | c.rgb.blue;
     };
 
-    qint64 deadline = now() + 20 * 1000;
-    while (1) {
-        // Linux pty buffer is fixed on page size
-        char buf[4096];
+    key->clear();
+    key->add(rgb(defaultBg));
+    key->add(static_cast<uint64_t>(qRound(devicePixelRatioF() * 100)));
+    for (int x = 0; x < m_vtermSize.width(); ++x) {
+        const VTermScreenCell *cell = &cells[x];
+
+        // The number of characters goes first so that keys of different
+        // rows can't come out the same
+        uint64_t nchars = 0;
+        while (nchars < VTERM_MAX_CHARS_PER_CELL && cell->chars[nchars])
+            nchars++;
+        key->add(rgb(cell->fg)
+                | rgb(cell->bg) << 24
+                | static_cast<uint64_t>(cell->attrs.underline) << 48
+                | static_cast<uint64_t>(cell->attrs.italic) << 50
+                | static_cast<uint64_t>(cell->attrs.strike) << 51
+                | static_cast<uint64_t>(cell->attrs.reverse) << 52
+                | nchars << 53
+                | static_cast<uint64_t>(static_cast<uint8_t>(cell->width)) << 56);
+        for (uint64_t i = 0; i < nchars; ++i)
+            key->add(cell->chars[i]);
+    }
+}
 
-        ssize_t n = read(fd, buf, sizeof(buf));
-        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
-            break;
+const QPixmap *QVTerm::rowImage(int y, const VTermColor &defaultBg)
+{
+    const RowKey *key = m_rowCache.key(y);
+    bool fetched = false;
+    if (!key) {
+        fetchRows(y, y + 1, &m_rowCells);
+        fetched = true;
+        rowKey(m_rowCells.data(), defaultBg, &m_rowKey);
+        m_rowCache.setKey(y, m_rowKey);
+        key = &m_rowKey;
+    }
+
+    if (const QPixmap *image = m_rowCache.find(*key))
+        return image;
+
+    if (!fetched)
+        fetchRows(y, y + 1, &m_rowCells);
 
-        if (n == 0 || (n == -1 && errno == EIO)) {
-            QCoreApplication::exit();
+    qreal dpr = devicePixelRatioF();
+    QPixmap image{
+            static_cast<int>(std::ceil(pixelCol(m_vtermSize.width()) * dpr)),
+            static_cast<int>(std::ceil(m_cellSize.height() * dpr))};
+    image.setDevicePixelRatio(dpr);
+    image.fill(toQColor(defaultBg));
+
+    QPainter p(&image);
+    p.setCompositionMode(QPainter::CompositionMode_Source);
+    paintRow(p, m_rowCells.data(), 0, m_vtermSize.width(), false, defaultBg);
+    p.end();
+
+    return m_rowCache.insert(*key, std::move(image));
+}
+
+void QVTerm::paintHighlights(QPainter &p, int row, int y, const VTermColor &defaultBg)
+{
+    int width = m_vtermSize.width();
+    int selStart = 0;
+    int selEnd = 0;
+    int matchStart = 0;
+    int matchEnd = 0;
+    bool selected = m_highlight->rowSpan(y, width, &selStart, &selEnd);
+    bool matched = m_matchRegion.rowSpan(y, width, &matchStart, &matchEnd);
+    if (!selected && !matched)
+        return;
+
+    fetchRows(y, y + 1, &m_rowCells);
+
+    p.save();
+    p.translate(0, pixelRow(row));
+    if (selected)
+        paintRow(p, m_rowCells.data(), selStart, selEnd, true, defaultBg);
+    if (matched)
+        paintRow(p, m_rowCells.data(), matchStart, matchEnd, true, defaultBg);
+    p.restore();
+}
+
+void QVTerm::updateHighlight(const Region &before)
+{
+    const Region after = m_highlight->active() ? m_highlight->region() : Region();
+
+    int first = std::numeric_limits<int>::max();
+    int last = std::numeric_limits<int>::min();
+    for (const Region *region : {&before, &after}) {
+        if (region->isNull())
+            continue;
+        first = std::min(first, region->start().y());
+        last = std::max(last, region->end().y());
+    }
+
+    // Only the rows whose highlighted columns changed need repainting, which
+    // during a drag is usually just the one under the mouse
+    int width = m_vtermSize.width();
+    int offset = static_cast<int>(m_scrollback->offset());
+    for (int y = std::max(first, -offset); y <= last && y + offset < m_vtermSize.height(); ++y) {
+        int oldStart = 0;
+        int oldEnd = 0;
+        int newStart = 0;
+        int newEnd = 0;
+        bool was = before.rowSpan(y, width, &oldStart, &oldEnd);
+        bool is = after.rowSpan(y, width, &newStart, &newEnd);
+        if (was != is || (is && (oldStart != newStart || oldEnd != newEnd)))
+            viewport()->update(pixelRect(0, y + offset, width, 1));
+    }
+}
+
+void QVTerm::paintRow(QPainter &p, const VTermScreenCell *cells, int start, int end, bool reverse, const VTermColor &defaultBg)
+{
+    QVector<quint32> glyphs{};
+    QVector<QPointF> positions{};
+    int style = 0;
+    bool underline = false;
+    bool strike = false;
+
+    auto paintBuffer = [this, &p, &glyphs, &positions, &style, &underline, &strike]() {
+        if (glyphs.isEmpty())
             return;
+
+        static QPointF origin{0, 0};
+
+        QGlyphRun run{};
+        run.setRawFont(m_glyphs.rawFont(style));
+        run.setGlyphIndexes(glyphs);
+        run.setPositions(positions);
+        run.setUnderline(underline);
+        run.setStrikeOut(strike);
+        p.drawGlyphRun(origin, run);
+
+        glyphs.clear();
+        positions.clear();
+    };
+
+    // Backgrounds go first, one fill for each run of cells sharing one, so
+    // that they don't cover glyphs reaching into the next cell
+    const VTermColor *fill = nullptr;
+    int fillStart = 0;
+    int fillEnd = 0;
+    for (int col = start; col < end; ++col) {
+        const VTermScreenCell *cell = &cells[col];
+        bool swap = static_cast<bool>(cell->attrs.reverse) != reverse;
+        const VTermColor *bg = swap ? &cell->fg : &cell->bg;
+
+        if (fill && !vterm_color_is_equal(bg, fill)) {
+            p.fillRect(pixelRect(fillStart, 0, fillEnd - fillStart, 1), toQColor(*fill));
+            fill = nullptr;
+        }
+        if (!fill && (reverse || !vterm_color_is_equal(bg, &defaultBg))) {
+            fill = bg;
+            fillStart = col;
+            fillEnd = col;
+        }
+        if (fill)
+            fillEnd = std::max(fillEnd, col + std::max<int>(cell->width, 1));
+    }
+    if (fill)
+        p.fillRect(pixelRect(fillStart, 0, fillEnd - fillStart, 1), toQColor(*fill));
+
+    for (int col = start; col < end; ++col) {
+        const VTermScreenCell *cell = &cells[col];
+        bool swap = static_cast<bool>(cell->attrs.reverse) != reverse;
+        const VTermColor *fg = swap ? &cell->bg : &cell->fg;
+
+        if (!cell->chars[0])
+            continue;
+
+        if (!colorEqual(p.pen().color(), *fg)) {
+            paintBuffer();
+            p.setPen(toQColor(*fg));
         }
 
-        if (n < 0) {
-            qFatal(strerror(errno));
-            exit(1);
+        // Bold is shown through bold_highbright rather than a bold font
+        int cellStyle = static_cast<bool>(cell->attrs.italic) ? GlyphCache::Italic : 0;
+        if (cellStyle != style) {
+            paintBuffer();
+            style = cellStyle;
         }
 
-        vterm_input_write(m_vterm, buf, n);
+        if (static_cast<bool>(cell->attrs.underline) != underline) {
+            paintBuffer();
+            underline = static_cast<bool>(cell->attrs.underline);
+        }
 
-        if (now() >= deadline)
-            break;
+        // No blink.
+
+        if (static_cast<bool>(cell->attrs.strike) != strike) {
+            paintBuffer();
+            strike = static_cast<bool>(cell->attrs.strike);
+        }
+
+        int n = m_glyphs.append(style, cell->chars, VTERM_MAX_CHARS_PER_CELL, &glyphs);
+        QPointF position{static_cast<qreal>(pixelCol(col)), static_cast<qreal>(m_cellBaseline)};
+        for (int i = 0; i < n; ++i)
+            positions.append(position);
     }
-    vterm_screen_flush_damage(m_vtermScreen);
-    flushToPty();
+    paintBuffer();
 }
 
-void QVTerm::pasteFromClipboard()
+void QVTerm::showMatch()
 {
+    if (!placeMatch())
+        return;
+
+    // Scroll matches in the scrollback to the middle of the screen
+    QPoint start = m_matchRegion.start();
+    QPoint end = m_matchRegion.end();
+    int offset = static_cast<int>(m_scrollback->offset());
+    if (start.y() + offset < 0 || end.y() + offset >= m_vtermSize.height()) {
+        int target = start.y() < 0 ? m_vtermSize.height() / 2 - start.y() : 0;
+        scrollContentsBy(0, target - offset);
+    }
+
+    QMutexLocker lock(&m_lock);
+    QString matched = m_matchRegion.dumpString(m_vtermSize, [this](int start, int end, std::vector<VTermScreenCell> *cells) {
+        fetchRows(start, end, cells);
+    });
+    lock.unlock();
+
     auto *cb = QApplication::clipboard();
+    cb->setText(matched, QClipboard::Selection);
+    viewport()->update(matchRect());
+}
 
-    vterm_keyboard_start_paste(m_vterm);
-    for (auto c : cb->text(QClipboard::Selection).toUcs4())
-        vterm_keyboard_unichar(m_vterm, c, VTERM_MOD_NONE);
-    vterm_keyboard_end_paste(m_vterm);
+bool QVTerm::placeMatch()
+{
+    const SearchMatch &match = m_matches[m_match];
+    QPoint start;
+    QPoint end;
+    if (!matchPoint(match.startLine, match.startCol, &start)
+            || !matchPoint(match.endLine, match.endCol, &end)) {
+        m_matchRegion = Region();
+        return false;
+    }
+    m_matchRegion = Region(start, end);
+    return true;
+}
 
-    if (!m_altscreen && m_scrollback->offset()) {
-        m_scrollback->unscroll();
-        viewport()->update();
+bool QVTerm::matchPoint(uint64_t line, int col, QPoint *point) const
+{
+    uint64_t screen = m_screenLine;
+    if (line >= screen) {
+        *point = {col, static_cast<int>(line - screen)};
+        return true;
     }
 
-    flushToPty();
-    return;
+    size_t row = 0;
+    int x = 0;
+    QMutexLocker lock(&m_lock);
+    if (!m_scrollback->rowOf(line, col, &row, &x))
+        return false;
+
+    *point = {x, -1 - static_cast<int>(row)};
+    return true;
+}
+
+QRect QVTerm::matchRect() const
+{
+    Region region = m_matchRegion;
+    region.shift({0, static_cast<int>(m_scrollback->offset())});
+    return region.pixelRect(m_vtermSize, m_cellSize);
 }
 
 void QVTerm::repaintCursor()
@@ -1,11 +1,20 @@
 #pragma once
 
+#include "glyphcache.hpp"
+#include "palette.hpp"
+#include "ptythread.hpp"
+#include "recording.hpp"
 #include "region.hpp"
+#include "rowcache.hpp"
+#include "scrollback.hpp"
+#include "search.hpp"
 
 #include <memory>
 
 #include <QAbstractScrollArea>
 #include <QContiguousCache>
+#include <QElapsedTimer>
+#include <QMutex>
 #include <QString>
 
 extern "C" {
@@ -13,15 +22,16 @@ extern "C" {
 }
 
 class QKeyEvent;
+class QPainter;
+class QProgressDialog;
 class QRegularExpression;
 class QRegularExpressionMatchIterator;
 class QResizeEvent;
-class QSocketNotifier;
+class QTimer;
 class QWidget;
 
 class Highlight;
 class Region;
-class Scrollback;
 
 class QVTerm : public QAbstractScrollArea {
     Q_OBJECT
@@ -30,12 +40,16 @@ public:
     ~QVTerm();
 
     /**
-     * Find matches for the given regular expression on the cells that are
-     * currently visible (not in the scrollback buffer).
+     * Find matches for the given regular expression on the screen and in the
+     * scrollback.  The search runs in the background and is cancelled by
+     * searching for something else, by matchClear() or by switching to or
+     * from the alternate screen.  Matches stay with their lines as output
+     * scrolls them into the scrollback.
      *
-     * If there are any matches, the first one (starting from the bottom of the
-     * screen) will be highlighted.  Successive calls to matchNext() will cycle
-     * through all visible matches.
+     * As soon as there are any matches, the first one (starting from the
+     * bottom of the screen) will be highlighted.  Calling this again with the
+     * same expression, or calling matchNext(), cycles through the matches found
+     * so far.
      *
      * @param regexp    - Regular expression to search for
      **/
@@ -51,13 +65,92 @@ public:
      **/
     void matchNext();
 
+    /**
+     * Record everything fed to the terminal, along with when it arrived and
+     * size changes, so that the session can be replayed.  Has to be called
+     * before start().
+     *
+     * @param path  - File to write the recording to
+     *
+     * @return  - false if the file could not be created
+     **/
+    bool record(const QString &path);
+
+    /**
+     * Feed a recording to the terminal instead of starting a shell.  The
+     * terminal keeps the sizes from the recording.  replayFinished() is
+     * emitted once all of it has been painted.
+     *
+     * @param path      - Recording made by record()
+     * @param realtime  - Keep the original timing instead of going as fast as
+     *                    frames allow
+     *
+     * @return  - false if the recording could not be read
+     **/
+    bool replay(const QString &path, bool realtime);
+
+    /**
+     * Time spent parsing and painting during the replay so far
+     **/
+    ReplayStats replayStats() const { return m_replayStats; }
+
     void scrollPage(int pages);
+
+    /**
+     * Copy rows of resolved cells, with colors in RGB, from the screen as of
+     * the last frame or from the scrollback
+     *
+     * @param start - First row in VTerm space, negative for the scrollback
+     * @param end   - Row after the last one
+     * @param cells - Resized to hold the rows one after another, with as many
+     *                cells as the terminal has columns per row
+     **/
+    void snapshotRows(int start, int end, std::vector<VTermScreenCell> *cells) const;
+
+    /**
+     * Current size of the scrollback
+     **/
+    ScrollbackUsage scrollbackUsage() const;
+
+    /**
+     * Scrollbar updates saved by updating it once per frame rather than once
+     * for every line pushed to or popped from the scrollback
+     **/
+    uint64_t scrollbarUpdatesSaved() const;
+
+    /**
+     * Hold frames back while an app is in the middle of a synchronized update
+     * (DEC private mode 2026), which is on by default
+     **/
+    void setSynchronizedUpdates(bool enabled) { m_sync.setEnabled(enabled); }
+
     void setFont(const QFont &font);
+
+    /**
+     * Limit the memory used by the scrollback, dropping the oldest lines to
+     * stay under it.
+     *
+     * @param bytes - maximum bytes to use or 0 for no limit
+     **/
+    void setScrollbackBudget(size_t bytes);
+
+    /**
+     * Keep only the most recent part of the scrollback in memory and move the
+     * rest to an unlinked file in XDG_RUNTIME_DIR.
+     *
+     * @param window    - number of lines to keep in memory
+     * @param capacity  - total number of lines to keep
+     *
+     * @return  - false if the file could not be created
+     **/
+    bool spillScrollback(size_t window, size_t capacity);
+
     void start();
 
 signals:
     void iconTextChanged(QString iconText);
     void titleChanged(QString title);
+    void replayFinished();
 
 protected:
     void focusInEvent(QFocusEvent *event) override;
@@ -73,7 +166,47 @@ protected:
     void scrollContentsBy(int dx, int dy) override;
 
 private:
-    // VTermScreenCallbacks
+    /**
+     * Terminal property change, copied out of its VTermValue
+     **/
+    struct Prop {
+        VTermProp prop;
+        bool boolean;
+        int number;
+        QString string;
+    };
+
+    /**
+     * Changes reported by libvterm that haven't been applied to the widget yet.
+     *
+     * Once more than a screenful has scrolled within a frame, the individual
+     * changes stop being recorded and the whole screen is repainted instead,
+     * like the jump scrolling of xterm.
+     **/
+    struct Frame {
+        struct Change {
+            VTermRect dest;
+            VTermRect src;
+            bool move;
+        };
+
+        // Damage and moves in the order they happened
+        std::vector<Change> changes{};
+        std::vector<Prop> props{};
+        bool cursorMoved{false};
+        VTermPos cursor{};
+        bool cursorVisible{false};
+
+        // Lines pushed to or popped from the scrollback
+        uint64_t scrollback{0};
+
+        // Rows scrolled by moves, and whether that was enough to jump
+        int scrolled{0};
+        bool jump{false};
+    };
+
+    // VTermScreenCallbacks, called with m_lock held on whichever thread is
+    // driving libvterm.  They only record changes in m_frame.
     int damage(VTermRect rect);
     int moverect(VTermRect dest, VTermRect src);
     int movecursor(VTermPos pos, VTermPos oldpos, int visible);
@@ -81,10 +214,17 @@ private:
     int sb_pushline(int cols, const VTermScreenCell *cells);
     int sb_popline(int cols, VTermScreenCell *cells);
 
+    // Apply what the callbacks recorded on the GUI thread
+    void applyDamage(VTermRect rect);
+    void applyMove(VTermRect dest, VTermRect src);
+    void applyCursor(VTermPos pos, bool visible);
+    void applyProp(const Prop &prop);
+
     void copyToClipboard();
 
     /**
-     * Fetch a cell
+     * Fetch a cell from the screen as of the last frame or from the
+     * scrollback.  m_lock must be held for the scrollback.
      *
      * @param x - x coordinate in VTerm space
      * @param y - y coordinate in VTerm space
@@ -94,11 +234,128 @@ private:
      **/
     const VTermScreenCell *fetchCell(int x, int y) const;
 
-    void flushToPty();
-    void onPtyInput(int fd);
+    /**
+     * Same as snapshotRows(), but m_lock must be held for the scrollback
+     **/
+    void fetchRows(int start, int end, std::vector<VTermScreenCell> *cells) const;
+
+    /**
+     * Apply and paint whatever changed since the last frame
+     **/
+    void flushFrame();
+
+    /**
+     * Milliseconds between frames, going by the refresh rate of the screen
+     **/
+    int frameInterval() const;
+
+    /**
+     * Paste the selection, showing progress if it's big enough to take a
+     * while to get through the PTY
+     **/
     void pasteFromClipboard();
     void repaintCursor();
 
+    /**
+     * Feed the recording until the next event is due, or for a frame when
+     * going as fast as possible
+     **/
+    void replayStep();
+
+    /**
+     * Resize the terminal and the PTY
+     *
+     * @param size  - Columns and rows
+     **/
+    void resizeTerminal(QSize size);
+
+    /**
+     * Flush damage now if a frame is due, otherwise arrange for it to be
+     * flushed when the next one is.  Parsing carries on in the meantime and
+     * libvterm merges the damage.  During a synchronized update it waits for
+     * the update to end, or to time out.
+     **/
+    void scheduleFrame();
+
+    /**
+     * Queue input for the PTY thread
+     **/
+    void sendInput(PtyThread::Input input);
+
+    /**
+     * Flush libvterm's damage and copy the rows it touched to m_screen.
+     * m_lock must be held.
+     **/
+    void syncScreen();
+
+    /**
+     * Gather everything that goes into painting a row
+     *
+     * @param cells     - Cells of the row
+     * @param defaultBg - Background color that isn't painted per cell
+     * @param key       - Where to put it
+     **/
+    void rowKey(const VTermScreenCell *cells, const VTermColor &defaultBg, RowKey *key) const;
+
+    /**
+     * Fetch the image of a row from the row cache, painting it if needed
+     *
+     * @param y         - y coordinate in VTerm space
+     * @param defaultBg - Background color that isn't painted per cell
+     *
+     * @return  - Image valid until the next row is painted
+     **/
+    const QPixmap *rowImage(int y, const VTermColor &defaultBg);
+
+    /**
+     * Paint cells of a row at the top of the painter
+     *
+     * @param cells     - Cells of the row
+     * @param start     - First column to paint
+     * @param end       - Column after the last one to paint
+     * @param reverse   - Swap the colors of every cell and paint all of their
+     *                    backgrounds, for highlighting over a painted row
+     * @param defaultBg - Background color that isn't painted per cell
+     **/
+    void paintRow(QPainter &p, const VTermScreenCell *cells, int start, int end, bool reverse, const VTermColor &defaultBg);
+
+    /**
+     * Paint the selection and the current match over a row
+     *
+     * @param row       - Row on the screen
+     * @param y         - y coordinate in VTerm space
+     * @param defaultBg - Background color that isn't painted per cell
+     **/
+    void paintHighlights(QPainter &p, int row, int y, const VTermColor &defaultBg);
+
+    /**
+     * Repaint the rows whose part of the selection changed
+     *
+     * @param before    - Region that was selected before the change
+     **/
+    void updateHighlight(const Region &before);
+
+    /**
+     * Highlight the current match and scroll it into view
+     **/
+    void showMatch();
+
+    /**
+     * Work out where the current match is now, after lines were pushed to
+     * or popped from the scrollback
+     *
+     * @return  - false if it is no longer in the scrollback
+     **/
+    bool placeMatch();
+
+    /**
+     * Convert a SearchMatch position to VTerm space
+     *
+     * @return  - false if the position is no longer in the scrollback
+     **/
+    bool matchPoint(uint64_t line, int col, QPoint *point) const;
+    QRect matchRect() const;
+
     /**
      * Convert VTerm coordinates to Qt pixel space
      **/
@@ -113,15 +370,68 @@ private:
     QSize m_vtermSize;
 
     int m_pty{-1};
-    QSocketNotifier *m_ptysn;
-    QByteArray m_ptyPending{};
+    std::unique_ptr<PtyThread> m_ptyThread;
+    QProgressDialog *m_pasteProgress{nullptr};
+
+    // Used with m_lock held
+    std::unique_ptr<Recorder> m_recorder;
+
+    std::unique_ptr<Recording> m_replay;
+    RecordedEvent m_replayEvent{};
+    bool m_replayPending{false};
+    bool m_replayRealtime{false};
+    QTimer *m_replayTimer{nullptr};
+    QElapsedTimer m_replayClock{};
+    // Microseconds into the replay that m_replayEvent is due at
+    qint64 m_replayDue{0};
+    ReplayStats m_replayStats{};
+
+    // Held by the PTY thread while parsing.  Guards m_vterm, m_scrollback,
+    // m_frame and m_dirtyRows.  The scroll offset of m_scrollback is only
+    // used on the GUI thread and doesn't need it.
+    mutable QMutex m_lock;
+    Frame m_frame{};
+
+    // Resolves cell colors on both threads, only loaded again with m_lock held
+    Palette m_palette{};
+    std::vector<bool> m_dirtyRows{};
+
+    // Screen as of the last frame, only used on the GUI thread.  Its top row
+    // is numbered m_screenLine, following on from the scrollback, and
+    // m_continuedRows tells which rows carry on from the one above.
+    std::vector<VTermScreenCell> m_screen{};
+    std::vector<bool> m_continuedRows{};
+    QSize m_screenSize{};
+    uint64_t m_screenLine{0};
+
+    QTimer *m_frameTimer;
+    QElapsedTimer m_lastFrame{};
+
+    // The last frame jumped, frames are spaced out until output calms down
+    bool m_jumping{false};
+
+    SyncUpdate m_sync{};
+    // The frame timer is waiting on a synchronized update
+    bool m_syncHeld{false};
+
+    // Scrollback lines applied by frames, and scrollbar calls made for them
+    uint64_t m_scrollbarLines{0};
+    uint64_t m_scrollbarUpdates{0};
 
     QFont m_font;
+    GlyphCache m_glyphs;
     QSize m_cellSize;
     int m_cellBaseline;
     bool m_altscreen{false};
     bool m_ignoreScroll{false};
 
+    RowCache m_rowCache;
+    VTermColor m_rowBg{};
+
+    // Cells and key of the row being painted
+    std::vector<VTermScreenCell> m_rowCells{};
+    RowKey m_rowKey{};
+
     struct {
         int row;
         int col;
@@ -131,6 +441,8 @@ private:
     std::unique_ptr<Highlight> m_highlight;
     std::unique_ptr<Scrollback> m_scrollback;
 
-    std::vector<Region> m_matches;
-    std::vector<Region>::const_reverse_iterator m_match;
+    std::unique_ptr<Search> m_search;
+    std::vector<SearchMatch> m_matches;
+    size_t m_match{0};
+    Region m_matchRegion;
 };
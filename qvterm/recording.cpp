@@ -0,0 +1,123 @@
+#include "recording.hpp"
+
+#include <QtGlobal>
+
+namespace {
+const char magic[] = "qvterm recording 1\n";
+const int magicLen = sizeof(magic) - 1;
+} // namespace
+
+bool Recorder::open(const QString &path)
+{
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning("recording %s: %s", qPrintable(path), qPrintable(m_file.errorString()));
+        return false;
+    }
+
+    m_file.write(magic, magicLen);
+    m_clock.start();
+    m_last = 0;
+    return true;
+}
+
+void Recorder::data(const char *data, size_t len)
+{
+    event(RecordedEvent::Data);
+    varint(len);
+    m_buf.append(data, static_cast<int>(len));
+    m_file.write(m_buf);
+}
+
+void Recorder::resize(int rows, int cols)
+{
+    event(RecordedEvent::Resize);
+    varint(static_cast<uint64_t>(rows));
+    varint(static_cast<uint64_t>(cols));
+    m_file.write(m_buf);
+    flush();
+}
+
+void Recorder::flush()
+{
+    m_file.flush();
+}
+
+void Recorder::event(RecordedEvent::Type type)
+{
+    qint64 now = m_clock.nsecsElapsed() / 1000;
+
+    m_buf.clear();
+    m_buf.append(static_cast<char>(type));
+    varint(static_cast<uint64_t>(now - m_last));
+    m_last = now;
+}
+
+void Recorder::varint(uint64_t value)
+{
+    while (value >= 0x80) {
+        m_buf.append(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    m_buf.append(static_cast<char>(value));
+}
+
+bool Recording::open(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning("recording %s: %s", qPrintable(path), qPrintable(file.errorString()));
+        return false;
+    }
+
+    m_data = file.readAll();
+    if (!m_data.startsWith(magic)) {
+        qWarning("recording %s: not a recording", qPrintable(path));
+        return false;
+    }
+    m_pos = magicLen;
+    return true;
+}
+
+bool Recording::next(RecordedEvent *event)
+{
+    if (m_pos == m_data.size())
+        return false;
+
+    event->type = static_cast<RecordedEvent::Type>(m_data[m_pos++]);
+    if (!varint(&event->delay))
+        return false;
+
+    uint64_t a;
+    uint64_t b;
+    switch (event->type) {
+        case RecordedEvent::Data:
+            if (!varint(&a) || a > static_cast<uint64_t>(m_data.size() - m_pos))
+                break;
+            event->data = m_data.mid(m_pos, static_cast<int>(a));
+            m_pos += static_cast<int>(a);
+            return true;
+        case RecordedEvent::Resize:
+            if (!varint(&a) || !varint(&b))
+                break;
+            event->rows = static_cast<int>(a);
+            event->cols = static_cast<int>(b);
+            return true;
+    }
+
+    qWarning("recording truncated or corrupt at offset %d", m_pos);
+    m_pos = m_data.size();
+    return false;
+}
+
+bool Recording::varint(uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; m_pos < m_data.size() && shift < 64; shift += 7) {
+        auto byte = static_cast<uint8_t>(m_data[m_pos++]);
+        *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QString>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * What was fed to libvterm during a session, with the time it arrived at and
+ * the size the terminal had, so that it can be replayed to reproduce problems.
+ *
+ * The file starts with a magic line, followed by events made up of a type
+ * byte, the microseconds since the previous event and the payload, with all
+ * numbers encoded as LEB128 varints.
+ **/
+struct RecordedEvent {
+    enum Type : uint8_t {
+        Data = 0,
+        Resize = 1,
+    };
+
+    Type type{Data};
+
+    // Microseconds since the previous event
+    uint64_t delay{0};
+
+    QByteArray data{};
+    int rows{0};
+    int cols{0};
+};
+
+/**
+ * Appends events to a recording as they happen
+ **/
+class Recorder {
+public:
+    /**
+     * Create or truncate the recording
+     *
+     * @return  - false if the file could not be written
+     **/
+    bool open(const QString &path);
+
+    /**
+     * Record data about to be fed to libvterm
+     **/
+    void data(const char *data, size_t len);
+
+    /**
+     * Record the terminal changing size
+     **/
+    void resize(int rows, int cols);
+
+    /**
+     * Write out what was recorded so far, so that it survives a crash
+     **/
+    void flush();
+
+private:
+    void event(RecordedEvent::Type type);
+    void varint(uint64_t value);
+
+    QFile m_file{};
+    QElapsedTimer m_clock{};
+    qint64 m_last{0};
+    QByteArray m_buf{};
+};
+
+/**
+ * Reads back the events of a recording
+ **/
+class Recording {
+public:
+    /**
+     * Read the recording into memory
+     *
+     * @return  - false if the file could not be read or isn't a recording
+     **/
+    bool open(const QString &path);
+
+    /**
+     * Read the next event
+     *
+     * @return  - false at the end of the recording or if it's truncated
+     **/
+    bool next(RecordedEvent *event);
+
+private:
+    bool varint(uint64_t *value);
+
+    QByteArray m_data{};
+    int m_pos{0};
+};
+
+/**
+ * Where the time went while replaying a recording
+ **/
+struct ReplayStats {
+    uint64_t bytes{0};
+    qint64 parseNs{0};
+    qint64 paintNs{0};
+    uint64_t frames{0};
+
+    // Frames flushed while an app was in the middle of a synchronized update
+    uint64_t tornFrames{0};
+
+    // Time taken by each paint
+    std::vector<qint64> paints{};
+};
@@ -15,17 +15,22 @@ Region Region::fromPixelSpace(const QPoint &start, const QPoint &end, const QSiz
             {end.x() % cellSize.width(), end.y() / cellSize.height()}};
 }
 
-QString Region::dump(const QSize &termSize, const std::function<const VTermScreenCell *(int, int)> &fetchCell) const
+QString Region::dump(const QSize &termSize, const std::function<void(int, int, std::vector<VTermScreenCell> *)> &fetchRows) const
 {
     QString r{};
     const VTermScreenCell *cell = nullptr;
+    std::vector<VTermScreenCell> cells{};
+    fetchRows(m_start.y(), m_end.y() + 1, &cells);
 
     for (int y = m_start.y(); y < m_end.y() + 1; ++y) {
-        int xStart = y == m_start.y() ? m_start.x() : 0;
-        int xEnd = y == m_end.y() ? m_end.x() + 1 : termSize.width();
+        // Selections can end past the last column
+        int xStart = 0;
+        int xEnd = 0;
+        rowSpan(y, termSize.width(), &xStart, &xEnd);
+        const VTermScreenCell *row = &cells[static_cast<size_t>((y - m_start.y()) * termSize.width())];
 
         for (int x = xStart; x < xEnd; ++x) {
-            cell = fetchCell(x, y);
+            cell = &row[x];
             if (cell->chars[0])
                 r.append(QString::fromUcs4(cell->chars, cell->width));
             else
@@ -35,18 +40,22 @@ QString Region::dump(const QSize &termSize, const std::function<const VTermScree
     return r;
 }
 
-QString Region::dumpString(const QSize &termSize, const std::function<const VTermScreenCell *(int, int)> &fetchCell) const
+QString Region::dumpString(const QSize &termSize, const std::function<void(int, int, std::vector<VTermScreenCell> *)> &fetchRows) const
 {
     QString r{};
     const VTermScreenCell *cell = nullptr;
+    std::vector<VTermScreenCell> cells{};
+    fetchRows(m_start.y(), m_end.y() + 1, &cells);
 
     for (int y = m_start.y(); y < m_end.y() + 1; ++y) {
-        int xStart = y == m_start.y() ? m_start.x() : 0;
-        int xEnd = y == m_end.y() ? m_end.x() + 1 : termSize.width();
+        int xStart = 0;
+        int xEnd = 0;
+        rowSpan(y, termSize.width(), &xStart, &xEnd);
+        const VTermScreenCell *row = &cells[static_cast<size_t>((y - m_start.y()) * termSize.width())];
         int skipped = 0;
 
         for (int x = xStart; x < xEnd; ++x) {
-            cell = fetchCell(x, y);
+            cell = &row[x];
             if (cell->chars[0]) {
                 for (; skipped; skipped--)
                     r.append(' ');
@@ -56,7 +65,9 @@ QString Region::dumpString(const QSize &termSize, const std::function<const VTer
             }
         }
 
-        if (!cell->chars[0])
+        // Rows ending in blanks, or selected only past their end, were ended
+        // by a newline rather than wrapped
+        if (skipped || xStart >= xEnd)
             r.append('\n');
     }
     return r;
@@ -4,7 +4,9 @@
 #include <QSize>
 #include <QString>
 
+#include <algorithm>
 #include <functional>
+#include <vector>
 
 class QDebug;
 
@@ -63,6 +65,36 @@ public:
                 && (y < m_end.y() || (y == m_end.y() && x <= m_end.x())));
     }
 
+    /**
+     * Test if any part of a row is inside of the region
+     *
+     * @param y - y coordinate
+     **/
+    bool containsRow(int y) const
+    {
+        return !isNull() && y >= m_start.y() && y <= m_end.y();
+    }
+
+    /**
+     * Columns of a row that are inside of the region
+     *
+     * @param y     - y coordinate
+     * @param width - number of columns in a row
+     * @param start - set to the first column inside
+     * @param end   - set to the column after the last one inside
+     *
+     * @return  - false if no part of the row is inside of the region
+     **/
+    bool rowSpan(int y, int width, int *start, int *end) const
+    {
+        if (!containsRow(y))
+            return false;
+
+        *start = y == m_start.y() ? std::max(m_start.x(), 0) : 0;
+        *end = y == m_end.y() ? std::min(m_end.x() + 1, width) : width;
+        return *start < *end;
+    }
+
     /**
      * Test if a region is inside of this one
      *
@@ -95,10 +127,10 @@ public:
      * Dump the contents of the region exactly as it is stored
      *
      * @param termSize  - size of terminal
-     * @param fetchCell - function that will return VTermScreenCells for a given
-     *                    position
+     * @param fetchRows - function that fills in the cells of the rows from
+     *                    start up to end, termSize.width() cells per row
      **/
-    QString dump(const QSize &termSize, const std::function<const VTermScreenCell *(int, int)> &fetchCell) const;
+    QString dump(const QSize &termSize, const std::function<void(int, int, std::vector<VTermScreenCell> *)> &fetchRows) const;
 
     /**
      * Dump the contents of the region.  Empty cells will be ignored unless they
@@ -106,10 +138,10 @@ public:
      * the expected behavior for a copy operation on a selected region.
      *
      * @param termSize  - size of terminal
-     * @param fetchCell - function that will return VTermScreenCells for a given
-     *                    position
+     * @param fetchRows - function that fills in the cells of the rows from
+     *                    start up to end, termSize.width() cells per row
      **/
-    QString dumpString(const QSize &termSize, const std::function<const VTermScreenCell *(int, int)> &fetchCell) const;
+    QString dumpString(const QSize &termSize, const std::function<void(int, int, std::vector<VTermScreenCell> *)> &fetchRows) const;
 
     /**
      * Endpoint of the region
@@ -0,0 +1,69 @@
+#include "rowcache.hpp"
+
+#include <algorithm>
+
+namespace {
+// Enough to page back and forth through the scrollback without repainting
+const int screensCached = 3;
+} // namespace
+
+void RowKey::clear()
+{
+    m_values.clear();
+    m_hash = 0;
+}
+
+void RowKey::add(uint64_t value)
+{
+    m_values.push_back(value);
+    m_hash = (m_hash ^ value) * 0x9e3779b97f4a7c15ULL;
+    m_hash ^= m_hash >> 29;
+}
+
+void RowCache::reset(int rows)
+{
+    rows = std::max(rows, 1);
+    m_images.clear();
+    m_images.setMaxCost(screensCached * rows);
+    m_keys.assign(static_cast<size_t>(rows), RowKey());
+    m_valid.assign(static_cast<size_t>(rows), false);
+}
+
+void RowCache::invalidate(int start, int end)
+{
+    start = std::max(start, 0);
+    end = std::min(end, static_cast<int>(m_valid.size()));
+    for (int row = start; row < end; ++row)
+        m_valid[static_cast<size_t>(row)] = false;
+}
+
+const RowKey *RowCache::key(int row) const
+{
+    if (row < 0 || static_cast<size_t>(row) >= m_valid.size() || !m_valid[static_cast<size_t>(row)])
+        return nullptr;
+
+    return &m_keys[static_cast<size_t>(row)];
+}
+
+void RowCache::setKey(int row, const RowKey &key)
+{
+    if (row < 0 || static_cast<size_t>(row) >= m_valid.size())
+        return;
+
+    m_keys[static_cast<size_t>(row)] = key;
+    m_valid[static_cast<size_t>(row)] = true;
+}
+
+const QPixmap *RowCache::find(const RowKey &key) const
+{
+    // A different row hashing the same is painted again and replaces it
+    const Entry *entry = m_images.object(key.hash());
+    return entry && entry->key == key ? &entry->image : nullptr;
+}
+
+const QPixmap *RowCache::insert(const RowKey &key, QPixmap image)
+{
+    auto *entry = new Entry{key, std::move(image)};
+    m_images.insert(key.hash(), entry);
+    return &entry->image;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QCache>
+#include <QPixmap>
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Everything that goes into painting a row, along with a hash of it
+ **/
+class RowKey {
+public:
+    void clear();
+    void add(uint64_t value);
+
+    uint64_t hash() const { return m_hash; };
+    bool operator==(const RowKey &other) const { return m_hash == other.m_hash && m_values == other.m_values; };
+
+private:
+    std::vector<uint64_t> m_values{};
+    uint64_t m_hash{0};
+};
+
+/**
+ * Rendered rows, keyed by everything that went into painting them, so that
+ * rows which haven't changed are drawn with a single blit.  Images are looked
+ * up by the hash of the key, and only used if the whole key matches.
+ *
+ * The key of each screen row is remembered until the row is damaged, which
+ * saves fetching its cells again.  Rows from the scrollback get their keys
+ * made every time they're painted and their images from the same cache, so
+ * scrolling back and forth mostly blits.
+ **/
+class RowCache {
+public:
+    /**
+     * Drop all images and hashes, for instance when the font changes
+     *
+     * @param rows  - Number of rows on the screen
+     **/
+    void reset(int rows);
+
+    /**
+     * Forget the keys of damaged screen rows
+     *
+     * @param start - First damaged row
+     * @param end   - Row after the last damaged one
+     **/
+    void invalidate(int start, int end);
+
+    /**
+     * Look up the key of a screen row
+     *
+     * @param row   - Screen row
+     *
+     * @return  - nullptr if the row was damaged since its key was set
+     **/
+    const RowKey *key(int row) const;
+
+    /**
+     * Remember the key of an undamaged screen row
+     **/
+    void setKey(int row, const RowKey &key);
+
+    /**
+     * Image of a row with the given key, or nullptr
+     **/
+    const QPixmap *find(const RowKey &key) const;
+
+    /**
+     * Add the image of a row, possibly evicting the least recently used ones
+     *
+     * @return  - the cached image, only valid until the next insert
+     **/
+    const QPixmap *insert(const RowKey &key, QPixmap image);
+
+private:
+    struct Entry {
+        RowKey key;
+        QPixmap image;
+    };
+
+    QCache<quint64, Entry> m_images{};
+    std::vector<RowKey> m_keys{};
+    std::vector<bool> m_valid{};
+};
@@ -1,59 +1,1173 @@
 #include "scrollback.hpp"
+#include "spillfile.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
-ScrollbackLine::ScrollbackLine(int cols, const VTermScreenCell *cells, VTermState *vts) :
-    m_cols(cols),
-    m_cells(std::make_unique<VTermScreenCell[]>(cols))
+namespace {
+// Style indices are stored in 24 bits
+constexpr uint32_t maxStyles = 1 << 24;
+
+// Table entries below which compacting isn't worth it
+constexpr size_t minTables = 4096;
+
+// Table index not yet assigned while remapping
+constexpr uint32_t unmapped = 0xffffffff;
+
+// Smallest arena allocation, in cells
+constexpr size_t minArena = 4096;
+
+// Lines per compressed block
+constexpr size_t blockLines = 256;
+
+// Decompressed blocks to keep around
+constexpr size_t decodedBlocks = 4;
+
+// Most lines joined into one when rewrapping, bounds the work done for a
+// single row of endless output.
+constexpr size_t maxJoin = 1024;
+
+constexpr uint32_t lineContinued = 1;
+
+// Serialized line, followed by ncells PackedCells
+struct LineHeader {
+    int32_t cols;
+    int32_t ncells;
+    PackedCell fill;
+    uint32_t flags;
+};
+static_assert(sizeof(LineHeader) % alignof(PackedCell) == 0, "PackedCells must stay aligned");
+
+// Serialized tables at the start of a compressed block, followed by nstyles
+// CellStyles and nclusters CellClusters.
+struct TablesHeader {
+    uint32_t nstyles;
+    uint32_t nclusters;
+};
+static_assert(sizeof(CellStyle) % alignof(PackedCell) == 0, "PackedCells must stay aligned");
+
+bool isBlank(const PackedCell &cell, const PackedCell &fill)
 {
-    memcpy(m_cells.get(), cells, cols * sizeof(cells[0]));
-    for (int i = 0; i < cols; ++i) {
-        vterm_state_convert_color_to_rgb(vts, &m_cells[i].fg);
-        vterm_state_convert_color_to_rgb(vts, &m_cells[i].bg);
+    return cell.ch == 0 && cell.width == fill.width && cell.style == fill.style;
+}
+
+size_t hotLines(size_t capacity, size_t hotCapacity)
+{
+    // Not worth compressing anything if there wouldn't be a full block
+    if (hotCapacity >= capacity || capacity - hotCapacity < blockLines)
+        return capacity;
+    return hotCapacity;
+}
+
+bool isCluster(const PackedCell &cell)
+{
+    return cell.ch != PackedCell::Continuation && (cell.ch & PackedCell::Cluster);
+}
+
+ScrollbackLine lineAt(const QByteArray &raw, uint32_t offset, const CellTables &tables)
+{
+    LineHeader hdr;
+    memcpy(&hdr, raw.constData() + offset, sizeof(hdr));
+    return {
+            hdr.cols,
+            hdr.ncells,
+            hdr.fill,
+            (hdr.flags & lineContinued) != 0,
+            reinterpret_cast<const PackedCell *>(raw.constData() + offset + sizeof(hdr)),
+            tables};
+}
+
+void appendLine(QByteArray *raw, const ScrollbackLine &sbl)
+{
+    LineHeader hdr{sbl.cols(), sbl.ncells(), sbl.fill(), sbl.continued() ? lineContinued : 0};
+
+    raw->append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    raw->append(
+            reinterpret_cast<const char *>(sbl.cells()),
+            static_cast<int>(sizeof(PackedCell)) * hdr.ncells);
+}
+
+void appendTables(QByteArray *raw, const CellTables &tables)
+{
+    TablesHeader hdr{static_cast<uint32_t>(tables.styles.size()), static_cast<uint32_t>(tables.clusters.size())};
+
+    raw->append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    raw->append(
+            reinterpret_cast<const char *>(tables.styles.data()),
+            static_cast<int>(sizeof(CellStyle) * tables.styles.size()));
+    raw->append(
+            reinterpret_cast<const char *>(tables.clusters.data()),
+            static_cast<int>(sizeof(CellCluster) * tables.clusters.size()));
+}
+
+/**
+ * Read the tables at the start of a decompressed block
+ *
+ * @return  - offset of the first line or the size of raw if it is truncated
+ **/
+size_t readTables(const QByteArray &raw, CellTables *tables)
+{
+    auto size = static_cast<size_t>(raw.size());
+    TablesHeader hdr;
+    if (size < sizeof(hdr))
+        return size;
+    memcpy(&hdr, raw.constData(), sizeof(hdr));
+
+    size_t stylesBytes = sizeof(CellStyle) * hdr.nstyles;
+    size_t clustersBytes = sizeof(CellCluster) * hdr.nclusters;
+    if (size < sizeof(hdr) + stylesBytes + clustersBytes)
+        return size;
+
+    tables->styles.resize(hdr.nstyles);
+    tables->clusters.resize(hdr.nclusters);
+    memcpy(tables->styles.data(), raw.constData() + sizeof(hdr), stylesBytes);
+    memcpy(tables->clusters.data(), raw.constData() + sizeof(hdr) + stylesBytes, clustersBytes);
+    return sizeof(hdr) + stylesBytes + clustersBytes;
+}
+
+/**
+ * Call fn with a pointer to every PackedCell of some serialized lines,
+ * including the fill of each line
+ **/
+template <typename Fn>
+void forEachCell(QByteArray *raw, const std::vector<uint32_t> &offsets, Fn fn)
+{
+    char *data = raw->data();
+    for (uint32_t offset : offsets) {
+        LineHeader hdr;
+        memcpy(&hdr, data + offset, sizeof(hdr));
+        fn(&hdr.fill);
+        memcpy(data + offset, &hdr, sizeof(hdr));
+
+        auto *cells = reinterpret_cast<PackedCell *>(data + offset + sizeof(hdr));
+        for (int32_t i = 0; i < hdr.ncells; ++i)
+            fn(&cells[i]);
+    }
+}
+
+/**
+ * Gathers the table entries a set of cells refers to into new tables,
+ * renumbering the cells as it goes
+ **/
+class TableRemap {
+public:
+    explicit TableRemap(const CellTables &from) :
+        m_from(from),
+        m_styles(from.styles.size(), unmapped),
+        m_clusters(from.clusters.size(), unmapped) {}
+
+    void operator()(PackedCell *cell)
+    {
+        uint32_t &style = m_styles[cell->style];
+        if (style == unmapped) {
+            style = static_cast<uint32_t>(tables.styles.size());
+            tables.styles.push_back(m_from.styles[cell->style]);
+        }
+        cell->style = style & (maxStyles - 1);
+
+        if (isCluster(*cell)) {
+            uint32_t &cluster = m_clusters[cell->ch & ~PackedCell::Cluster];
+            if (cluster == unmapped) {
+                cluster = static_cast<uint32_t>(tables.clusters.size());
+                tables.clusters.push_back(m_from.clusters[cell->ch & ~PackedCell::Cluster]);
+            }
+            cell->ch = PackedCell::Cluster | cluster;
+        }
+    }
+
+    CellTables tables;
+
+private:
+    const CellTables &m_from;
+    std::vector<uint32_t> m_styles;
+    std::vector<uint32_t> m_clusters;
+};
+
+std::vector<uint32_t> indexLines(const QByteArray &raw, size_t start)
+{
+    std::vector<uint32_t> offsets;
+    size_t offset = start;
+    while (offset + sizeof(LineHeader) <= static_cast<size_t>(raw.size())) {
+        LineHeader hdr;
+        memcpy(&hdr, raw.constData() + offset, sizeof(hdr));
+        offsets.push_back(static_cast<uint32_t>(offset));
+        offset += sizeof(hdr) + sizeof(PackedCell) * static_cast<size_t>(hdr.ncells);
+    }
+    return offsets;
+}
+
+size_t fnv1a(const void *data, size_t len)
+{
+    auto *p = static_cast<const uint8_t *>(data);
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3;
+    }
+    return static_cast<size_t>(h);
+}
+
+CellStyle styleOf(const VTermScreenCell &cell)
+{
+    // Zero everything first so that padding and unused bitfield space are
+    // stable for hashing and comparison.
+    CellStyle style;
+    memset(&style, 0, sizeof(style));
+
+    style.fg.type = cell.fg.type;
+    style.fg.rgb.red = cell.fg.rgb.red;
+    style.fg.rgb.green = cell.fg.rgb.green;
+    style.fg.rgb.blue = cell.fg.rgb.blue;
+    style.bg.type = cell.bg.type;
+    style.bg.rgb.red = cell.bg.rgb.red;
+    style.bg.rgb.green = cell.bg.rgb.green;
+    style.bg.rgb.blue = cell.bg.rgb.blue;
+
+    style.attrs.bold = cell.attrs.bold;
+    style.attrs.underline = cell.attrs.underline;
+    style.attrs.italic = cell.attrs.italic;
+    style.attrs.blink = cell.attrs.blink;
+    style.attrs.reverse = cell.attrs.reverse;
+    style.attrs.strike = cell.attrs.strike;
+    style.attrs.font = cell.attrs.font;
+    style.attrs.dwl = cell.attrs.dwl;
+    style.attrs.dhl = cell.attrs.dhl;
+    return style;
+}
+} // namespace
+
+bool ScrollbackSnapshot::visit(const std::function<bool(uint64_t, const ScrollbackLine &)> &fn, const LineFilter &filter) const
+{
+    uint64_t seq = m_serial;
+    for (const auto &chunk : m_chunks) {
+        // Decide whether a compressed block can be skipped before going
+        // through the trouble of decompressing it.
+        if (chunk.compressed && !filter.wanted(seq - (blockLines - chunk.skip), seq - 1)) {
+            seq -= blockLines - chunk.skip;
+            continue;
+        }
+
+        QByteArray raw;
+        if (!chunk.compressed)
+            raw = chunk.data;
+        else if (!chunk.data.isEmpty())
+            raw = qUncompress(chunk.data);
+        else if (m_spill)
+            raw = qUncompress(m_spill->read(chunk.spillOffset, chunk.spillLength));
+
+        CellTables blockTables;
+        size_t start = chunk.compressed ? readTables(raw, &blockTables) : 0;
+        const CellTables &tables = chunk.compressed ? blockTables : *m_tables;
+
+        // The block may have been dropped from the spill file since, skip it
+        // but keep the numbering intact.
+        auto offsets = indexLines(raw, start);
+        if (chunk.compressed && offsets.size() != blockLines) {
+            seq -= blockLines - chunk.skip;
+            continue;
+        }
+
+        for (size_t i = offsets.size(); i-- > chunk.skip;) {
+            seq--;
+            if (filter.wanted(seq, seq) && !fn(seq, lineAt(raw, offsets[i], tables)))
+                return false;
+        }
+    }
+    return true;
+}
+
+CellCluster ScrollbackLine::chars(const PackedCell &cell) const
+{
+    if (isCluster(cell))
+        return m_clusters[cell.ch & ~PackedCell::Cluster];
+
+    CellCluster chars{};
+    chars[0] = cell.ch;
+    return chars;
+}
+
+void ScrollbackLine::unpack(const PackedCell &packed, VTermScreenCell *cell) const
+{
+    if (isCluster(packed)) {
+        const auto &cluster = m_clusters[packed.ch & ~PackedCell::Cluster];
+        memcpy(cell->chars, cluster.data(), sizeof(cell->chars));
+    } else {
+        cell->chars[0] = packed.ch;
+        cell->chars[1] = 0;
     }
+    cell->width = static_cast<char>(packed.width);
+
+    const auto &style = m_styles[packed.style];
+    cell->attrs = style.attrs;
+    cell->fg = style.fg;
+    cell->bg = style.bg;
+}
+
+bool CellStyle::operator==(const CellStyle &other) const
+{
+    return memcmp(this, &other, sizeof(*this)) == 0;
 }
 
-const VTermScreenCell *ScrollbackLine::cell(int i) const
+size_t CellStyleHash::operator()(const CellStyle &style) const
 {
-    assert(i > 0 && i < m_cols);
-    return &m_cells[i];
+    return fnv1a(&style, sizeof(style));
 }
 
-Scrollback::Scrollback(size_t capacity) :
-    m_capacity(capacity)
+size_t CellClusterHash::operator()(const CellCluster &cluster) const
 {
+    return fnv1a(cluster.data(), sizeof(cluster[0]) * cluster.size());
 }
 
-void Scrollback::emplace(int cols, const VTermScreenCell *cells, VTermState *vts)
+Scrollback::Scrollback(size_t capacity, size_t hotCapacity) :
+    m_capacity(capacity),
+    m_hotCapacity(hotLines(capacity, hotCapacity)),
+    m_slots(m_hotCapacity)
+{
+}
+
+Scrollback::~Scrollback() = default;
+
+void Scrollback::setCapacity(size_t capacity)
 {
-    m_deque.emplace_front(cols, cells, vts);
-    while (m_deque.size() > m_capacity)
-        m_deque.pop_back();
+    if (m_capacity == m_hotCapacity)
+        return;
+
+    m_capacity = std::max(capacity, m_hotCapacity + blockLines);
+    trim();
+}
+
+void Scrollback::setBudget(size_t bytes)
+{
+    m_budget = bytes;
+
+    // The arena stops growing at half the budget, bring it back down there
+    // by compressing lines.
+    size_t cells = std::max(minArena, m_budget / 2 / sizeof(PackedCell));
+    if (m_budget && m_arena.size() > cells) {
+        while (m_count && m_arenaUsed > cells)
+            evict();
+        resizeArena(cells);
+    }
+
+    trim();
+}
+
+ScrollbackUsage Scrollback::usage() const
+{
+    return {
+            size(),
+            storedBytes() + decodedBytes(),
+            m_spilledBytes,
+            m_index.bytes(),
+    };
+}
+
+bool Scrollback::spill(size_t window)
+{
+    if (!m_spill) {
+        auto spill = std::make_unique<SpillFile>();
+        if (!spill->open())
+            return false;
+        m_spill = std::move(spill);
+    }
+
+    m_window = window;
+    spillBlocks();
+    return true;
+}
+
+ScrollbackLine Scrollback::line(size_t index) const
+{
+    assert(index < size());
+    if (index < m_count) {
+        const Slot &slot = m_slots[slotIndex(index)];
+        return {slot.cols, slot.ncells, slot.fill, slot.continued, m_arena.data() + slot.offset, m_tables};
+    }
+
+    index -= m_count;
+    if (index < m_pendingOffsets.size())
+        return lineAt(m_pending, m_pendingOffsets[m_pendingOffsets.size() - 1 - index], m_tables);
+
+    index -= m_pendingOffsets.size();
+    const auto &block = decode(index / blockLines);
+    return lineAt(block.raw, block.offsets[blockLines - 1 - index % blockLines], block.tables);
+}
+
+const VTermScreenCell *Scrollback::cell(size_t index, int col) const
+{
+    auto sbl = line(index);
+    if (col < 0 || col >= sbl.cols())
+        return nullptr;
+
+    sbl.unpack(sbl.cell(col), &m_cell);
+    return &m_cell;
+}
+
+void Scrollback::setWidth(int cols)
+{
+    if (cols == m_width)
+        return;
+
+    m_width = cols;
+    resetRows();
+}
+
+size_t Scrollback::rows(size_t limit) const
+{
+    if (!m_width)
+        return std::min(limit, size());
+
+    pruneRows();
+    uint64_t oldest = oldestSeq();
+    while (m_rows.size() < limit && m_rowsEnd > oldest) {
+        uint64_t start = groupStart(m_rowsEnd - 1);
+        wrapGroup(start, m_rowsEnd - 1, &m_group);
+        m_rows.insert(m_rows.end(), m_group.rbegin(), m_group.rend());
+        m_rowsEnd = start;
+    }
+
+    return std::min(limit, m_rows.size());
+}
+
+const VTermScreenCell *Scrollback::rowCell(size_t row, int col) const
+{
+    if (!m_width)
+        return row < size() ? cell(row, col) : nullptr;
+
+    if (col < 0 || col >= m_width || rows(row + 1) <= row)
+        return nullptr;
+
+    uint64_t seq = m_rows[row].seq;
+    col += m_rows[row].col;
+    while (true) {
+        auto sbl = line(seqIndex(seq));
+        if (col < sbl.cols()) {
+            sbl.unpack(sbl.cell(col), &m_cell);
+            return &m_cell;
+        }
+
+        // Fetching the next line may evict the block this one is in
+        int cols = sbl.cols();
+        sbl.unpack(sbl.fill(), &m_cell);
+        if (seq + 1 == m_serial || !line(seqIndex(seq + 1)).continued())
+            return &m_cell;
+
+        col -= cols;
+        seq++;
+    }
+}
+
+bool Scrollback::fetchRow(size_t row, int cols, VTermScreenCell *cells) const
+{
+    VTermScreenCell empty{};
+    empty.width = 1;
+
+    if (!m_width) {
+        if (row >= size())
+            return false;
+
+        auto sbl = line(row);
+        int n = std::min(cols, sbl.cols());
+        for (int i = 0; i < n; ++i)
+            sbl.unpack(sbl.cell(i), &cells[i]);
+        std::fill(cells + std::max(n, 0), cells + cols, empty);
+        return true;
+    }
+
+    if (rows(row + 1) <= row)
+        return false;
+
+    int n = std::min(cols, m_width);
+    uint64_t seq = m_rows[row].seq;
+    int col = m_rows[row].col;
+    int i = 0;
+    while (i < n) {
+        auto sbl = line(seqIndex(seq));
+        for (; i < n && col < sbl.cols(); ++i, ++col)
+            sbl.unpack(sbl.cell(col), &cells[i]);
+
+        // Fetching the next line may evict the block this one is in
+        int lineCols = sbl.cols();
+        VTermScreenCell fill{};
+        if (i < n)
+            sbl.unpack(sbl.fill(), &fill);
+        if (i < n && (seq + 1 == m_serial || !line(seqIndex(seq + 1)).continued()))
+            std::fill(cells + i, cells + n, fill);
+
+        col -= lineCols;
+        seq++;
+    }
+    std::fill(cells + std::max(n, 0), cells + cols, empty);
+    return true;
+}
+
+bool Scrollback::rowOf(uint64_t seq, int col, size_t *row, int *x) const
+{
+    if (seq < oldestSeq() || seq >= m_serial)
+        return false;
+
+    if (!m_width) {
+        *row = seqIndex(seq);
+        *x = col;
+        return true;
+    }
+
+    while (m_rowsEnd > seq)
+        rows(m_rows.size() + 1);
+
+    // Rows are ordered newest first, find the last one starting at or before
+    // the position.
+    auto found = std::partition_point(m_rows.begin(), m_rows.end(), [seq, col](const Row &r) {
+        return r.seq > seq || (r.seq == seq && r.col > col);
+    });
+    if (found == m_rows.end())
+        return false;
+
+    *row = static_cast<size_t>(found - m_rows.begin());
+    *x = col - found->col;
+    for (uint64_t s = found->seq; s < seq; ++s)
+        *x += line(seqIndex(s)).cols();
+    *x = std::min(*x, m_width - 1);
+    return true;
+}
+
+ScrollbackSnapshot Scrollback::snapshot() const
+{
+    ScrollbackSnapshot snap;
+    snap.m_serial = m_serial;
+    snap.m_tables = std::make_shared<CellTables>(m_tables);
+    snap.m_spill = m_spill;
+
+    // The ring is overwritten in place, everything else can be shared
+    if (m_count) {
+        QByteArray hot;
+        for (size_t i = m_count; i-- > 0;)
+            appendLine(&hot, line(i));
+        snap.m_chunks.push_back({hot, false, 0, 0, 0});
+    }
+
+    if (!m_pendingOffsets.empty())
+        snap.m_chunks.push_back({m_pending, false, 0, 0, 0});
+
+    for (size_t i = 0; i < m_cold.size(); ++i) {
+        const ColdBlock &block = m_cold[i];
+        snap.m_chunks.push_back({
+                block.data,
+                true,
+                block.spillOffset,
+                block.spillLength,
+                i + 1 == m_cold.size() ? m_coldTrim : 0,
+        });
+    }
+
+    return snap;
+}
+
+void Scrollback::emplace(int cols, const VTermScreenCell *cells, const Palette &palette, bool wrapped)
+{
+    if (!m_hotCapacity || cols <= 0)
+        return;
+
+    reserveTables(static_cast<size_t>(cols));
+    m_scratch.resize(static_cast<size_t>(cols));
+    m_text.clear();
+    for (int i = 0; i < cols; ++i) {
+        VTermScreenCell cell = cells[i];
+        palette.resolve(&cell.fg);
+        palette.resolve(&cell.bg);
+        m_scratch[i] = pack(cell);
+    }
+
+    // The final cell decides what the line is padded with, anything blank
+    // and styled the same way before it doesn't need to be stored.
+    PackedCell fill{};
+    fill.style = m_scratch[cols - 1].style;
+    fill.width = 1;
+
+    int ncells = cols;
+    while (ncells > 0 && isBlank(m_scratch[ncells - 1], fill))
+        ncells--;
+
+    bool continued = m_wrapped && m_joined < maxJoin && size();
+    m_joined = continued ? m_joined + 1 : 1;
+    m_wrapped = wrapped;
+
+    Slot &slot = allocate(static_cast<size_t>(ncells));
+    slot.cols = cols;
+    slot.ncells = ncells;
+    slot.fill = fill;
+    slot.continued = continued;
+    std::copy_n(m_scratch.data(), ncells, m_arena.data() + slot.offset);
+
+    for (int i = 0; i < ncells; ++i) {
+        if (cells[i].chars[0] == PackedCell::Continuation)
+            continue;
+        if (!cells[i].chars[0])
+            m_text.push_back(' ');
+        for (int j = 0; j < VTERM_MAX_CHARS_PER_CELL && cells[i].chars[j]; ++j)
+            m_text.push_back(cells[i].chars[j]);
+    }
+    m_index.add(m_serial, continued, m_text.data(), m_text.size());
+    m_serial++;
+
+    trim();
+    wrapNewest();
 }
 
 void Scrollback::popto(int cols, VTermScreenCell *cells)
 {
-    const auto &sbl = m_deque.front();
+    auto sbl = line(0);
+    bool continued = sbl.continued();
 
     int ncells = cols;
     if (ncells > sbl.cols())
         ncells = sbl.cols();
 
-    memcpy(cells, sbl.cells(), sizeof(cells[0]) * ncells);
+    for (int i = 0; i < ncells; ++i)
+        sbl.unpack(sbl.cell(i), &cells[i]);
+
     for (size_t i = ncells; i < static_cast<size_t>(cols); ++i) {
         cells[i].chars[0] = '\0';
         cells[i].width = 1;
         cells[i].bg = cells[ncells - 1].bg;
     }
 
-    m_deque.pop_front();
+    dropNewest();
+    m_serial--;
+
+    // The line that was popped carried on from the one now newest
+    m_wrapped = false;
+    m_joined = 0;
+    if (size()) {
+        m_wrapped = continued;
+        m_joined = static_cast<size_t>(m_serial - groupStart(m_serial - 1));
+    }
+    resetRows();
+
+    // Nothing references the tables anymore, start over rather than letting
+    // them accumulate for the lifetime of the terminal.
+    if (!size())
+        compactTables();
 }
 
 size_t Scrollback::scroll(int delta)
 {
     m_offset = std::min(
             std::max(0, static_cast<int>(m_offset) + delta),
-            static_cast<int>(m_deque.size()));
+            static_cast<int>(rows(m_offset + static_cast<size_t>(std::max(delta, 0)))));
     return m_offset;
 }
+
+Scrollback::Slot &Scrollback::allocate(size_t ncells)
+{
+    if (m_count == m_hotCapacity)
+        evict();
+
+    size_t offset = 0;
+    size_t span = 0;
+    while (!fit(ncells, &offset, &span)) {
+        // Growing doubles the arena, don't let that take more than half of
+        // the budget and make room by retiring lines instead.
+        if (m_budget && m_count && m_arena.size() * 2 * sizeof(PackedCell) > m_budget / 2)
+            evict();
+        else
+            grow(ncells);
+    }
+
+    m_arenaHead = offset + ncells;
+    if (m_arenaHead == m_arena.size())
+        m_arenaHead = 0;
+    m_arenaUsed += span;
+
+    Slot &slot = m_slots[m_slotHead];
+    slot = {offset, span, 0, 0, {}, false};
+    m_slotHead = (m_slotHead + 1) % m_hotCapacity;
+    m_count++;
+
+    return slot;
+}
+
+void Scrollback::evict()
+{
+    if (m_capacity > m_hotCapacity)
+        retire(line(m_count - 1));
+    dropOldestHot();
+}
+
+bool Scrollback::dropOldest()
+{
+    if (!m_cold.empty()) {
+        if (++m_coldTrim < blockLines)
+            return true;
+
+        releaseBlock(m_cold.back());
+        m_cold.pop_back();
+        m_coldTrim = 0;
+        return true;
+    }
+
+    // Partial blocks are dropped as a whole, the same granularity at which
+    // compressed lines actually free memory.
+    if (!m_pendingOffsets.empty()) {
+        m_pending.clear();
+        m_pendingOffsets.clear();
+        return true;
+    }
+
+    // Always keep the line that was just pushed
+    if (m_count > 1) {
+        dropOldestHot();
+        return true;
+    }
+    return false;
+}
+
+void Scrollback::dropOldestHot()
+{
+    const Slot &oldest = m_slots[slotIndex(m_count - 1)];
+    m_arenaUsed -= oldest.span;
+    m_count--;
+
+    if (!m_count)
+        m_arenaHead = 0;
+}
+
+void Scrollback::dropNewest()
+{
+    if (m_count) {
+        const Slot &slot = m_slots[slotIndex(0)];
+        m_arenaUsed -= slot.span;
+
+        // Blank lines don't take any cells, and only ever pushing those never
+        // allocates the arena
+        if (slot.span)
+            m_arenaHead = (m_arenaHead + m_arena.size() - slot.span) % m_arena.size();
+        m_slotHead = (m_slotHead + m_hotCapacity - 1) % m_hotCapacity;
+        m_count--;
+
+        if (!m_count)
+            m_arenaHead = 0;
+        return;
+    }
+
+    if (m_pendingOffsets.empty()) {
+        // Bring the newest compressed block back so lines can be taken off
+        // of it one at a time, its cells now refer to the tables of the
+        // scrollback.  With the ring empty nothing else does, so they're
+        // started over and there's room for anything in the block.
+        compactTables();
+        const auto &decoded = decode(0);
+        uint32_t start = decoded.offsets.front();
+        m_pending = decoded.raw.mid(static_cast<int>(start));
+        m_pendingOffsets = decoded.offsets;
+        for (auto &offset : m_pendingOffsets)
+            offset -= start;
+        const CellTables &tables = decoded.tables;
+        forEachCell(&m_pending, m_pendingOffsets, [this, &tables](PackedCell *cell) {
+            cell->style = internStyle(tables.styles[cell->style]) & (maxStyles - 1);
+            if (isCluster(*cell))
+                cell->ch = PackedCell::Cluster | internCluster(tables.clusters[cell->ch & ~PackedCell::Cluster]);
+        });
+        releaseBlock(m_cold.front());
+        m_cold.pop_front();
+
+        if (m_cold.empty() && m_coldTrim) {
+            uint32_t skip = m_pendingOffsets[m_coldTrim];
+            m_pending.remove(0, static_cast<int>(skip));
+            m_pendingOffsets.erase(m_pendingOffsets.begin(), m_pendingOffsets.begin() + static_cast<long>(m_coldTrim));
+            for (auto &offset : m_pendingOffsets)
+                offset -= skip;
+            m_coldTrim = 0;
+        }
+    }
+
+    m_pending.truncate(static_cast<int>(m_pendingOffsets.back()));
+    m_pendingOffsets.pop_back();
+}
+
+void Scrollback::retire(const ScrollbackLine &sbl)
+{
+    m_pendingOffsets.push_back(static_cast<uint32_t>(m_pending.size()));
+    appendLine(&m_pending, sbl);
+
+    if (m_pendingOffsets.size() == blockLines)
+        compressPending();
+}
+
+void Scrollback::compressPending()
+{
+    // The block gets tables of its own, so that once it is dropped nothing
+    // else holds on to what only its lines referred to.
+    TableRemap remap(m_tables);
+    forEachCell(&m_pending, m_pendingOffsets, std::ref(remap));
+
+    QByteArray raw;
+    appendTables(&raw, remap.tables);
+    raw.append(m_pending);
+    m_cold.push_front({m_coldSerial++, qCompress(raw), 0, 0});
+
+    // qCompress() leaves room for the worst case, which is larger than the
+    // raw block
+    m_cold.front().data.squeeze();
+    m_coldBytes += static_cast<size_t>(m_cold.front().data.size());
+    m_memoryBlocks++;
+    m_pending.clear();
+    m_pendingOffsets.clear();
+
+    if (m_spill)
+        spillBlocks();
+}
+
+void Scrollback::spillBlocks()
+{
+    while (m_memoryBlocks
+            && m_count + m_pendingOffsets.size() + m_memoryBlocks * blockLines > m_window) {
+        ColdBlock &block = m_cold[m_memoryBlocks - 1];
+        int64_t offset = m_spill->append(block.data.constData(), static_cast<size_t>(block.data.size()));
+        if (offset < 0)
+            return;
+
+        block.spillOffset = static_cast<uint64_t>(offset);
+        block.spillLength = static_cast<uint32_t>(block.data.size());
+        m_coldBytes -= block.spillLength;
+        m_spilledBytes += block.spillLength;
+        block.data = QByteArray();
+        m_memoryBlocks--;
+    }
+}
+
+void Scrollback::releaseBlock(const ColdBlock &block)
+{
+    uint64_t serial = block.serial;
+    m_decoded.erase(
+            std::remove_if(m_decoded.begin(), m_decoded.end(), [serial](const DecodedBlock &d) {
+                return d.serial == serial;
+            }),
+            m_decoded.end());
+
+    if (block.data.isEmpty()) {
+        m_spill->release(block.spillOffset, block.spillLength);
+        m_spilledBytes -= block.spillLength;
+    } else {
+        m_coldBytes -= static_cast<size_t>(block.data.size());
+        m_memoryBlocks--;
+    }
+}
+
+const Scrollback::DecodedBlock &Scrollback::decode(size_t block) const
+{
+    uint64_t serial = m_cold[block].serial;
+    auto found = std::find_if(m_decoded.begin(), m_decoded.end(), [serial](const DecodedBlock &d) {
+        return d.serial == serial;
+    });
+
+    if (found != m_decoded.end()) {
+        std::rotate(m_decoded.begin(), found, found + 1);
+        return m_decoded.front();
+    }
+
+    if (m_decoded.size() == decodedBlocks)
+        m_decoded.pop_back();
+
+    const ColdBlock &cold = m_cold[block];
+    DecodedBlock decoded{serial, {}, {}, {}};
+    if (cold.data.isEmpty()) {
+        decoded.raw = qUncompress(
+                reinterpret_cast<const uchar *>(m_spill->data(cold.spillOffset)),
+                static_cast<int>(cold.spillLength));
+    } else {
+        decoded.raw = qUncompress(cold.data);
+    }
+    decoded.offsets = indexLines(decoded.raw, readTables(decoded.raw, &decoded.tables));
+    assert(decoded.offsets.size() == blockLines);
+    m_decoded.insert(m_decoded.begin(), std::move(decoded));
+    return m_decoded.front();
+}
+
+size_t Scrollback::storedBytes() const
+{
+    return m_arena.size() * sizeof(PackedCell)
+            + m_slots.size() * sizeof(Slot)
+            + static_cast<size_t>(m_pending.capacity())
+            + m_pendingOffsets.capacity() * sizeof(uint32_t)
+            + m_cold.size() * sizeof(ColdBlock)
+            + m_coldBytes
+            + m_rows.size() * sizeof(Row)
+            + m_index.bytes()
+            + tableBytes();
+}
+
+size_t Scrollback::decodedBytes() const
+{
+    size_t bytes = 0;
+    for (const auto &block : m_decoded)
+        bytes += static_cast<size_t>(block.raw.size()) + block.offsets.size() * sizeof(uint32_t) + block.tables.bytes();
+    return bytes;
+}
+
+size_t Scrollback::tableBytes() const
+{
+    // Rough cost of a node in the index, key and value plus a next pointer
+    // and cached hash.
+    constexpr size_t nodeOverhead = 2 * sizeof(void *);
+
+    return m_tables.bytes()
+            + m_styleIndex.size() * (sizeof(CellStyle) + sizeof(uint32_t) + nodeOverhead)
+            + m_styleIndex.bucket_count() * sizeof(void *)
+            + m_clusterIndex.size() * (sizeof(CellCluster) + sizeof(uint32_t) + nodeOverhead)
+            + m_clusterIndex.bucket_count() * sizeof(void *);
+}
+
+void Scrollback::trim()
+{
+    while (size() > m_capacity)
+        dropOldest();
+
+    while (m_budget && storedBytes() > m_budget && (!m_cold.empty() || !m_pendingOffsets.empty())) {
+        dropOldest();
+        m_index.prune(oldestSeq());
+        pruneRows();
+    }
+
+    // Lines in the ring only give memory back through the tables, the arena
+    // is kept in check when allocating instead.  Drop half of them at a time
+    // so compacting stays rare.
+    while (m_budget && m_count > 1 && storedBytes() > m_budget && tableBytes() >= storedBytes() - m_budget) {
+        for (size_t n = m_count / 2; n > 0; --n)
+            dropOldestHot();
+        compactTables();
+        m_index.prune(oldestSeq());
+        pruneRows();
+    }
+
+    m_index.prune(oldestSeq());
+}
+
+void Scrollback::pruneRows() const
+{
+    // Once the start of the oldest line has been dropped, what's left of it
+    // is wrapped again as if it started with the oldest line remaining.
+    uint64_t oldest = oldestSeq();
+    if (!m_rows.empty() && m_rows.back().seq < oldest) {
+        uint64_t end = oldest;
+        while (end + 1 < m_serial && line(seqIndex(end + 1)).continued())
+            end++;
+
+        while (!m_rows.empty() && m_rows.back().seq <= end)
+            m_rows.pop_back();
+        m_rowsEnd = end + 1;
+    }
+}
+
+size_t Scrollback::coldSize() const
+{
+    return m_cold.empty() ? 0 : m_cold.size() * blockLines - m_coldTrim;
+}
+
+bool Scrollback::fit(size_t ncells, size_t *offset, size_t *span) const
+{
+    size_t size = m_arena.size();
+    if (m_arenaUsed + ncells > size)
+        return false;
+
+    // Used cells run from tail up to, but not including, head.
+    size_t tail = size ? (m_arenaHead + size - m_arenaUsed) % size : 0;
+    if (m_arenaHead >= tail) {
+        if (size - m_arenaHead >= ncells) {
+            *offset = m_arenaHead;
+            *span = ncells;
+            return true;
+        }
+
+        // Skip the end of the arena and wrap around to the start
+        if (tail >= ncells) {
+            *offset = 0;
+            *span = size - m_arenaHead + ncells;
+            return true;
+        }
+        return false;
+    }
+
+    if (tail - m_arenaHead >= ncells) {
+        *offset = m_arenaHead;
+        *span = ncells;
+        return true;
+    }
+    return false;
+}
+
+void Scrollback::grow(size_t ncells)
+{
+    resizeArena(std::max({
+            m_arena.size() * 2,
+            m_arenaUsed + ncells,
+            minArena}));
+}
+
+void Scrollback::resizeArena(size_t size)
+{
+    std::vector<PackedCell> arena(size);
+
+    // Lay the lines out again from oldest to newest, dropping any space that
+    // was lost to wrapping.
+    size_t head = 0;
+    for (size_t i = m_count; i-- > 0;) {
+        Slot &slot = m_slots[slotIndex(i)];
+        auto n = static_cast<size_t>(slot.ncells);
+        std::copy_n(m_arena.data() + slot.offset, n, arena.data() + head);
+        slot.offset = head;
+        slot.span = n;
+        head += n;
+    }
+
+    m_arena.swap(arena);
+    m_arenaHead = head;
+    m_arenaUsed = head;
+}
+
+uint64_t Scrollback::groupStart(uint64_t seq) const
+{
+    uint64_t oldest = oldestSeq();
+    while (seq > oldest && line(seqIndex(seq)).continued())
+        seq--;
+    return seq;
+}
+
+void Scrollback::wrapGroup(uint64_t start, uint64_t end, std::vector<Row> *rows) const
+{
+    rows->clear();
+
+    // Every line but the last one is full, trailing blanks of the last one
+    // don't need a row of their own unless the whole line is blank.
+    size_t width = static_cast<size_t>(m_width);
+    size_t base = 0;
+    for (uint64_t seq = start; seq <= end; ++seq) {
+        auto sbl = line(seqIndex(seq));
+        auto len = static_cast<size_t>(seq == end ? std::max(sbl.ncells(), 1) : sbl.cols());
+
+        size_t next = rows->size() * width;
+        for (; next < base + len; next += width)
+            rows->push_back({seq, static_cast<int>(next - base)});
+        base += len;
+    }
+}
+
+void Scrollback::wrapNewest()
+{
+    if (!m_width || size() == 0)
+        return;
+
+    if (m_rows.empty()) {
+        m_rowsEnd = m_serial;
+        return;
+    }
+
+    uint64_t start = groupStart(m_serial - 1);
+    while (!m_rows.empty() && m_rows.front().seq >= start)
+        m_rows.pop_front();
+
+    wrapGroup(start, m_serial - 1, &m_group);
+    m_rows.insert(m_rows.begin(), m_group.rbegin(), m_group.rend());
+}
+
+void Scrollback::resetRows()
+{
+    m_rows.clear();
+    m_rowsEnd = m_serial;
+}
+
+void Scrollback::reserveTables(size_t ncells)
+{
+    // Entries only referred to by lines which have been compressed since are
+    // dead weight, clear them out once there are as many as there are live
+    // ones.
+    size_t entries = m_tables.styles.size() + m_tables.clusters.size();
+    bool full = m_tables.styles.size() + ncells > maxStyles || m_tables.clusters.size() + ncells > maxStyles;
+    if (!full && (entries < minTables || entries < 2 * m_tablesLive))
+        return;
+
+    compactTables();
+    if (m_tables.styles.size() + ncells <= maxStyles && m_tables.clusters.size() + ncells <= maxStyles)
+        return;
+
+    // Each cell could have a style of its own, drop lines until there's
+    // certainly room rather than lose any.
+    auto cells = [this]() {
+        return m_arenaUsed + m_count + static_cast<size_t>(m_pending.size()) / sizeof(PackedCell);
+    };
+    while (cells() + ncells > maxStyles && dropOldest())
+        ;
+    compactTables();
+}
+
+void Scrollback::compactTables()
+{
+    TableRemap remap(m_tables);
+    for (size_t i = 0; i < m_count; ++i) {
+        Slot &slot = m_slots[slotIndex(i)];
+        remap(&slot.fill);
+        for (int col = 0; col < slot.ncells; ++col)
+            remap(&m_arena[slot.offset + static_cast<size_t>(col)]);
+    }
+    forEachCell(&m_pending, m_pendingOffsets, std::ref(remap));
+
+    // Fresh indices, clearing them would keep the buckets
+    m_tables = std::move(remap.tables);
+    decltype(m_styleIndex)().swap(m_styleIndex);
+    for (size_t i = 0; i < m_tables.styles.size(); ++i)
+        m_styleIndex.emplace(m_tables.styles[i], static_cast<uint32_t>(i));
+    decltype(m_clusterIndex)().swap(m_clusterIndex);
+    for (size_t i = 0; i < m_tables.clusters.size(); ++i)
+        m_clusterIndex.emplace(m_tables.clusters[i], static_cast<uint32_t>(i));
+    m_tablesLive = m_tables.styles.size() + m_tables.clusters.size();
+}
+
+uint32_t Scrollback::internStyle(const CellStyle &style)
+{
+    // Runs of cells mostly share a style, checking against the table itself
+    // keeps this right across compactions
+    if (m_lastStyle < m_tables.styles.size() && m_tables.styles[m_lastStyle] == style)
+        return m_lastStyle;
+
+    auto found = m_styleIndex.find(style);
+    if (found == m_styleIndex.end()) {
+        auto idx = static_cast<uint32_t>(m_tables.styles.size());
+        m_tables.styles.push_back(style);
+        found = m_styleIndex.emplace(style, idx).first;
+    }
+    m_lastStyle = found->second;
+    return m_lastStyle;
+}
+
+uint32_t Scrollback::internCluster(const CellCluster &cluster)
+{
+    auto found = m_clusterIndex.find(cluster);
+    if (found == m_clusterIndex.end()) {
+        auto idx = static_cast<uint32_t>(m_tables.clusters.size());
+        m_tables.clusters.push_back(cluster);
+        found = m_clusterIndex.emplace(cluster, idx).first;
+    }
+    return found->second;
+}
+
+PackedCell Scrollback::pack(const VTermScreenCell &cell)
+{
+    PackedCell packed{};
+    packed.width = static_cast<uint8_t>(cell.width);
+
+    if (cell.chars[0] == PackedCell::Continuation) {
+        packed.ch = PackedCell::Continuation;
+    } else if (cell.chars[0] && cell.chars[1]) {
+        CellCluster cluster{};
+        for (size_t i = 0; i < cluster.size() && cell.chars[i]; ++i)
+            cluster[i] = cell.chars[i];
+        packed.ch = PackedCell::Cluster | internCluster(cluster);
+    } else {
+        packed.ch = cell.chars[0];
+    }
+
+    // There's always room, see reserveTables()
+    packed.style = internStyle(styleOf(cell)) & (maxStyles - 1);
+    return packed;
+}
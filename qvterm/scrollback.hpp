@@ -1,45 +1,508 @@
 #pragma once
 
+#include "palette.hpp"
+#include "trigramindex.hpp"
+
+#include <array>
+#include <cstdint>
 #include <deque>
+#include <functional>
 #include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <QByteArray>
 
 extern "C" {
 #include <vterm.h>
 }
 
+class SpillFile;
+
+/**
+ * Compact form of a VTermScreenCell as stored in the scrollback.
+ *
+ * Colors and attributes are replaced by an index into a style table.  Cells
+ * holding combining characters store an index into a cluster table with the
+ * Cluster bit set in ch.  See CellTables for which tables those are.
+ **/
+struct PackedCell {
+    static constexpr uint32_t Cluster = 0x80000000;
+
+    // Right half of a double width character, as reported by libvterm
+    static constexpr uint32_t Continuation = 0xffffffff;
+
+    uint32_t ch;
+    uint32_t style : 24;
+    uint32_t width : 8;
+};
+
+/**
+ * Colors and attributes shared by any number of cells
+ **/
+struct CellStyle {
+    VTermColor fg;
+    VTermColor bg;
+    VTermScreenCellAttrs attrs;
+
+    bool operator==(const CellStyle &other) const;
+};
+
+struct CellStyleHash {
+    size_t operator()(const CellStyle &style) const;
+};
+
+using CellCluster = std::array<uint32_t, VTERM_MAX_CHARS_PER_CELL>;
+
+struct CellClusterHash {
+    size_t operator()(const CellCluster &cluster) const;
+};
+
+/**
+ * Styles and clusters PackedCells refer to.  Each compressed block of lines
+ * has tables of its own which go away along with it, the uncompressed lines
+ * share the tables of the Scrollback.
+ **/
+struct CellTables {
+    std::vector<CellStyle> styles;
+    std::vector<CellCluster> clusters;
+
+    size_t bytes() const { return styles.capacity() * sizeof(CellStyle) + clusters.capacity() * sizeof(CellCluster); };
+};
+
+/**
+ * Memory used by a Scrollback
+ **/
+struct ScrollbackUsage {
+    // Lines of history
+    size_t lines;
+
+    // Bytes held in memory
+    size_t bytes;
+
+    // Bytes moved out of memory and into a spill file
+    size_t spilledBytes;
+
+    // Bytes used by the search index, included in bytes
+    size_t indexBytes;
+
+    double bytesPerLine() const { return lines ? static_cast<double>(bytes) / static_cast<double>(lines) : 0; };
+};
+
+/**
+ * View of a single line stored in a Scrollback.  Only valid until the
+ * Scrollback is next modified or another line is fetched from it.
+ *
+ * Trailing blank cells sharing the style of the final cell are not stored,
+ * cell() fills them back in.  A continued line is the remainder of the line
+ * pushed before it, wrapped at the terminal width of the time.
+ **/
 class ScrollbackLine {
 public:
-    ScrollbackLine(int cols, const VTermScreenCell *cells, VTermState *vts);
-    ScrollbackLine(ScrollbackLine &&other) = default;
-    ScrollbackLine() = delete;
+    ScrollbackLine(int cols, int ncells, PackedCell fill, bool continued, const PackedCell *cells, const CellTables &tables) :
+        m_cols(cols),
+        m_ncells(ncells),
+        m_fill(fill),
+        m_continued(continued),
+        m_cells(cells),
+        m_styles(tables.styles.data()),
+        m_clusters(tables.clusters.data()){};
 
     int cols() const { return m_cols; };
-    const VTermScreenCell *cell(int i) const;
-    const VTermScreenCell *cells() const { return &m_cells[0]; };
+    int ncells() const { return m_ncells; };
+    const PackedCell *cells() const { return m_cells; };
+    const PackedCell &cell(int col) const { return col < m_ncells ? m_cells[col] : m_fill; };
+    const PackedCell &fill() const { return m_fill; };
+    bool continued() const { return m_continued; };
+
+    /**
+     * Characters of a cell of this line, up to VTERM_MAX_CHARS_PER_CELL of
+     * them
+     **/
+    CellCluster chars(const PackedCell &cell) const;
+
+    /**
+     * Reconstruct a cell of this line
+     **/
+    void unpack(const PackedCell &packed, VTermScreenCell *cell) const;
 
 private:
     int m_cols;
-    std::unique_ptr<VTermScreenCell[]> m_cells;
+    int m_ncells;
+    PackedCell m_fill;
+    bool m_continued;
+    const PackedCell *m_cells;
+    const CellStyle *m_styles;
+    const CellCluster *m_clusters;
+};
+
+/**
+ * Copy of the lines held by a Scrollback at one point in time.  Shares the
+ * compressed blocks with the Scrollback rather than copying them, and can be
+ * read from any thread.
+ **/
+class ScrollbackSnapshot {
+public:
+    ScrollbackSnapshot() = default;
+
+    /**
+     * Sequence number of the line after the newest one
+     **/
+    uint64_t serial() const { return m_serial; };
+
+    /**
+     * Visit the lines, newest first
+     *
+     * @param fn        - called with the sequence number of each line,
+     *                    returning false stops the walk
+     * @param filter    - lines to visit, see Scrollback::filter()
+     *
+     * @return  - false if the walk was stopped early
+     **/
+    bool visit(
+            const std::function<bool(uint64_t, const ScrollbackLine &)> &fn,
+            const LineFilter &filter = LineFilter()) const;
+
+private:
+    friend class Scrollback;
+
+    /**
+     * Serialized lines, oldest first, which may still have to be
+     * decompressed or read back from the spill file.  Compressed blocks
+     * carry their own tables.
+     **/
+    struct Chunk {
+        QByteArray data;
+        bool compressed;
+        uint64_t spillOffset;
+        uint32_t spillLength;
+
+        // Leading lines which are no longer part of the scrollback
+        size_t skip;
+    };
+
+    std::vector<Chunk> m_chunks;
+    uint64_t m_serial{0};
+
+    // Tables of the chunks which aren't compressed
+    std::shared_ptr<const CellTables> m_tables;
+    std::shared_ptr<const SpillFile> m_spill;
 };
 
+/**
+ * Terminal history.
+ *
+ * The most recent lines are kept uncompressed in a ring.  Lines that fall out
+ * of the ring are gathered into fixed size blocks which are compressed and
+ * only decompressed again when a line in them is fetched.  Optionally, blocks
+ * can be moved out of memory entirely, see spill().
+ *
+ * Lines are stored as they were pushed, at whatever width the terminal had.
+ * Once setWidth() is given a different width, rows() and rowCell() present
+ * them rewrapped to it.  The rewrapped rows are only worked out when asked
+ * for, newest first, so changing the width costs nothing up front.
+ **/
 class Scrollback {
 public:
-    Scrollback(size_t capacity);
+    /**
+     * Create a new scrollback
+     *
+     * @param capacity      - maximum number of lines to keep
+     * @param hotCapacity   - number of recent lines to keep uncompressed
+     **/
+    Scrollback(size_t capacity, size_t hotCapacity);
     Scrollback() = delete;
+    ~Scrollback();
 
     size_t capacity() const { return m_capacity; };
-    size_t size() const { return m_deque.size(); };
+    size_t size() const { return m_count + m_pendingOffsets.size() + coldSize(); };
     size_t offset() const { return m_offset; };
 
-    const ScrollbackLine &line(size_t index) const { return m_deque.at(index); };
+    /**
+     * Sequence number the next line pushed will get, see snapshot()
+     **/
+    uint64_t serial() const { return m_serial; };
+
+    /**
+     * Fetch a line
+     *
+     * @param index - line to fetch, 0 is the most recently pushed
+     **/
+    ScrollbackLine line(size_t index) const;
+
+    /**
+     * Reconstruct a single cell
+     *
+     * @param index - line to fetch from, 0 is the most recently pushed
+     * @param col   - column within the line
+     *
+     * @return  - Cell which is valid until the next call or nullptr if col is
+     *            outside of the line.
+     **/
+    const VTermScreenCell *cell(size_t index, int col) const;
+
+    /**
+     * Rewrap lines to the given width from now on
+     *
+     * @param cols  - width to wrap at or 0 to present lines as stored
+     **/
+    void setWidth(int cols);
+
+    /**
+     * Number of rows at the current width.  Rewrapping stops as soon as limit
+     * rows are known, so the result is at most limit.
+     *
+     * @param limit - number of rows needed
+     **/
+    size_t rows(size_t limit) const;
+
+    /**
+     * Reconstruct a single cell of a rewrapped row
+     *
+     * @param row   - row to fetch from, 0 is the most recent
+     * @param col   - column within the row
+     *
+     * @return  - Cell which is valid until the next call or nullptr if there
+     *            is no such row or col is outside of the width.
+     **/
+    const VTermScreenCell *rowCell(size_t row, int col) const;
+
+    /**
+     * Reconstruct a whole rewrapped row, which is much cheaper than going
+     * through rowCell() for each of its cells
+     *
+     * @param row   - row to fetch, 0 is the most recent
+     * @param cols  - number of cells to fill, past the width they're empty
+     * @param cells - where to put the cells
+     *
+     * @return  - false if there is no such row
+     **/
+    bool fetchRow(size_t row, int cols, VTermScreenCell *cells) const;
+
+    /**
+     * Find where a position within a line ended up after rewrapping
+     *
+     * @param seq   - sequence number of the line, see snapshot()
+     * @param col   - column within the line
+     * @param row   - set to the row, 0 is the most recent
+     * @param x     - set to the column within the row
+     *
+     * @return  - false if the line is no longer in the scrollback
+     **/
+    bool rowOf(uint64_t seq, int col, size_t *row, int *x) const;
 
-    void emplace(int cols, const VTermScreenCell *cells, VTermState *vts);
+    /**
+     * Take a snapshot of the lines currently held.  Lines in the snapshot are
+     * numbered by sequence number, which starts at 0 for the first line ever
+     * pushed and is not affected by pushing or dropping other lines.
+     **/
+    ScrollbackSnapshot snapshot() const;
+
+    /**
+     * Narrow down the lines that could contain any of several texts
+     *
+     * @param text  - literal text, each needs at least 3 characters to
+     *                narrow anything down
+     *
+     * @return  - filter for ScrollbackSnapshot::visit(), which may still let
+     *            through lines not containing the text
+     **/
+    LineFilter filter(const QStringList &text) const { return m_index.query(text); };
+
+    /**
+     * Change the maximum number of lines to keep.  Has no effect if the
+     * scrollback was created without room for compressed lines.
+     *
+     * @param capacity  - maximum number of lines to keep
+     **/
+    void setCapacity(size_t capacity);
+
+    /**
+     * Move compressed lines out of memory and into a SpillFile once they are
+     * more than window lines old.
+     *
+     * @param window    - number of lines to keep in memory
+     *
+     * @return  - false if the spill file could not be created
+     **/
+    bool spill(size_t window);
+
+    /**
+     * Limit the memory used to store lines.  The oldest lines are dropped
+     * whenever the limit is exceeded.  Covers everything usage() reports
+     * except the few decompressed blocks kept around for fetching lines, the
+     * uncompressed lines get at most half of it.
+     *
+     * @param bytes - maximum bytes to use or 0 for no limit
+     **/
+    void setBudget(size_t bytes);
+
+    /**
+     * Current memory usage
+     **/
+    ScrollbackUsage usage() const;
+
+    /**
+     * Push a line, its colors are resolved to RGB with palette
+     *
+     * @param wrapped   - whether the line carries on in the next one pushed,
+     *                    rows are only joined when this says so
+     **/
+    void emplace(int cols, const VTermScreenCell *cells, const Palette &palette, bool wrapped);
     void popto(int cols, VTermScreenCell *cells);
     size_t scroll(int delta);
     void unscroll() { m_offset = 0; };
 
 private:
+    /**
+     * Line record in the ring.  Cells live in the arena starting at offset,
+     * span additionally counts any arena cells skipped when wrapping.
+     **/
+    struct Slot {
+        size_t offset;
+        size_t span;
+        int cols;
+        int ncells;
+        PackedCell fill;
+        bool continued;
+    };
+
+    /**
+     * Start of a rewrapped row, col may be past the width of the line
+     **/
+    struct Row {
+        uint64_t seq;
+        int col;
+    };
+
+    /**
+     * Compressed block of lines, oldest line first
+     **/
+    struct ColdBlock {
+        uint64_t serial;
+
+        // Compressed lines, empty if they have been moved to the spill file
+        QByteArray data;
+        uint64_t spillOffset;
+        uint32_t spillLength;
+    };
+
+    /**
+     * Decompressed copy of a ColdBlock
+     **/
+    struct DecodedBlock {
+        uint64_t serial;
+        QByteArray raw;
+        std::vector<uint32_t> offsets;
+        CellTables tables;
+    };
+
+    /**
+     * Reserve space in the arena for a new line, evicting the oldest line
+     * when the ring is full.
+     *
+     * @param ncells    - number of cells required
+     *
+     * @return  - Slot for the new line, already pushed into the ring.
+     **/
+    Slot &allocate(size_t ncells);
+    void evict();
+    bool dropOldest();
+    void dropOldestHot();
+    void dropNewest();
+    void retire(const ScrollbackLine &sbl);
+    void compressPending();
+    void reserveTables(size_t ncells);
+    void compactTables();
+    uint32_t internStyle(const CellStyle &style);
+    uint32_t internCluster(const CellCluster &cluster);
+    void spillBlocks();
+    void releaseBlock(const ColdBlock &block);
+    const DecodedBlock &decode(size_t block) const;
+    size_t coldSize() const;
+    size_t storedBytes() const;
+    size_t decodedBytes() const;
+    size_t tableBytes() const;
+    void trim();
+    void pruneRows() const;
+    bool fit(size_t ncells, size_t *offset, size_t *span) const;
+    void grow(size_t ncells);
+    void resizeArena(size_t size);
+    size_t slotIndex(size_t index) const { return (m_slotHead + m_hotCapacity - 1 - index) % m_hotCapacity; };
+
+    // Lines are also numbered by a sequence number, which unlike the index
+    // doesn't change as lines are pushed.
+    uint64_t oldestSeq() const { return m_serial - size(); };
+    size_t seqIndex(uint64_t seq) const { return static_cast<size_t>(m_serial - 1 - seq); };
+
+    uint64_t groupStart(uint64_t seq) const;
+    void wrapGroup(uint64_t start, uint64_t end, std::vector<Row> *rows) const;
+    void wrapNewest();
+    void resetRows();
+
+    PackedCell pack(const VTermScreenCell &cell);
+
     size_t m_capacity;
+    size_t m_hotCapacity;
+    size_t m_budget{0};
     size_t m_offset{0};
-    std::deque<ScrollbackLine> m_deque;
+
+    // Sequence number of the next line pushed
+    uint64_t m_serial{0};
+
+    // Whether the newest line wrapped into the next one and how many lines
+    // have been joined that way.
+    bool m_wrapped{false};
+    size_t m_joined{0};
+
+    // Rewrapped rows, newest first, covering every line from m_rowsEnd on
+    int m_width{0};
+    mutable std::deque<Row> m_rows;
+    mutable uint64_t m_rowsEnd{0};
+    mutable std::vector<Row> m_group;
+
+    // Ring of line records, m_slotHead is where the next line is written
+    std::vector<Slot> m_slots;
+    size_t m_slotHead{0};
+    size_t m_count{0};
+
+    // Ring of cells backing the line records, m_arenaHead is where the next
+    // line is written and m_arenaUsed includes space lost to wrapping.
+    std::vector<PackedCell> m_arena;
+    size_t m_arenaHead{0};
+    size_t m_arenaUsed{0};
+
+    // Lines retired from the ring but not yet compressed, serialized the
+    // same way as a decoded ColdBlock.
+    QByteArray m_pending;
+    std::vector<uint32_t> m_pendingOffsets;
+
+    // Compressed blocks, newest first.  The first m_coldTrim lines of the
+    // oldest block have already been dropped.  Only the newest m_memoryBlocks
+    // are held in memory, the rest are in m_spill.
+    std::deque<ColdBlock> m_cold;
+    size_t m_coldTrim{0};
+    size_t m_memoryBlocks{0};
+    size_t m_coldBytes{0};
+    size_t m_spilledBytes{0};
+    size_t m_window{0};
+    std::shared_ptr<SpillFile> m_spill;
+    uint64_t m_coldSerial{0};
+    mutable std::vector<DecodedBlock> m_decoded;
+
+    // Tables of the ring and the pending lines, m_tablesLive is how many
+    // entries were left after they were last compacted.
+    CellTables m_tables;
+    std::unordered_map<CellStyle, uint32_t, CellStyleHash> m_styleIndex;
+    uint32_t m_lastStyle{0};
+    std::unordered_map<CellCluster, uint32_t, CellClusterHash> m_clusterIndex;
+    size_t m_tablesLive{0};
+
+    TrigramIndex m_index;
+
+    // Cells and text of the line being pushed, before trimming
+    std::vector<PackedCell> m_scratch;
+    std::vector<uint32_t> m_text;
+
+    mutable VTermScreenCell m_cell;
 };
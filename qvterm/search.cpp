@@ -0,0 +1,426 @@
+#include "search.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+namespace {
+// Longest a match may wait before being reported
+constexpr qint64 reportInterval = 50;
+
+/**
+ * Parser for the literal text that matches of an expression have to contain,
+ * for narrowing down the lines to search.  Only the common syntax is
+ * understood, anything else just narrows things down less.
+ *
+ * Text is given as alternatives, one of which every match contains.  An empty
+ * list means nothing is known.
+ **/
+class RequiredText {
+public:
+    explicit RequiredText(const QString &pattern) :
+        m_pattern(pattern) {}
+
+    QStringList parse()
+    {
+        QStringList text = alternation();
+
+        // Unbalanced parentheses, leave it to the expression to complain.
+        // Whitespace and comments would be taken for literal text.
+        return m_pos == m_pattern.size() && !m_unbalanced && !m_extended ? text : QStringList();
+    }
+
+private:
+    /**
+     * Branches separated by |, up to the end of a group
+     **/
+    QStringList alternation()
+    {
+        QStringList text = sequence();
+        bool known = !text.isEmpty();
+        while (m_pos < m_pattern.size() && m_pattern[m_pos] == '|') {
+            m_pos++;
+            QStringList branch = sequence();
+            known = known && !branch.isEmpty();
+            text += branch;
+        }
+        return known ? text : QStringList();
+    }
+
+    /**
+     * A single branch, giving the best of the literal runs and groups in it
+     **/
+    QStringList sequence()
+    {
+        static const QString special("^$.|");
+        QStringList best;
+        QString run;
+        auto endRun = [&best, &run]() {
+            consider(&best, QStringList(run));
+            run.clear();
+        };
+
+        while (m_pos < m_pattern.size()) {
+            QChar c = m_pattern[m_pos];
+            if (c == '|' || c == ')')
+                break;
+
+            m_pos++;
+            if (c == '(') {
+                endRun();
+                bool lookaround = skipGroupFlags();
+                QStringList group = alternation();
+                if (m_pos < m_pattern.size())
+                    m_pos++;
+                else
+                    m_unbalanced = true;
+
+                // Optional groups can't be relied on
+                if (!lookaround && !quantifier())
+                    consider(&best, group);
+                continue;
+            }
+
+            if (c == '[') {
+                skipClass();
+                quantifier();
+                endRun();
+                continue;
+            }
+
+            if (c == '\\') {
+                if (m_pos == m_pattern.size())
+                    break;
+
+                // Character classes, back references and the like
+                c = m_pattern[m_pos++];
+                if (c.isLetterOrNumber()) {
+                    skipEscape(c);
+                    endRun();
+                    quantifier();
+                    continue;
+                }
+            } else if (special.contains(c)) {
+                endRun();
+                quantifier();
+                continue;
+            }
+
+            // Optional characters can't be relied on, repeated ones end the
+            // part that's known to be contiguous
+            bool repeated = false;
+            if (quantifier(&repeated)) {
+                endRun();
+                continue;
+            }
+            run.append(c);
+            if (repeated)
+                endRun();
+        }
+        endRun();
+        return best;
+    }
+
+    /**
+     * Skip a quantifier, if there is one
+     *
+     * @param repeated  - set if whatever it applies to may repeat
+     *
+     * @return  - true if whatever it applies to may not be there at all
+     **/
+    bool quantifier(bool *repeated = nullptr)
+    {
+        if (m_pos == m_pattern.size())
+            return false;
+
+        QChar c = m_pattern[m_pos];
+        bool optional = false;
+        if (c == '?' || c == '*') {
+            optional = true;
+        } else if (c == '+') {
+            if (repeated)
+                *repeated = true;
+        } else if (c == '{') {
+            optional = m_pos + 1 < m_pattern.size() && m_pattern[m_pos + 1] == '0';
+            if (repeated)
+                *repeated = true;
+            while (m_pos < m_pattern.size() && m_pattern[m_pos] != '}')
+                m_pos++;
+        } else {
+            return false;
+        }
+        m_pos++;
+
+        // Lazy and possessive quantifiers
+        if (m_pos < m_pattern.size() && (m_pattern[m_pos] == '?' || m_pattern[m_pos] == '+'))
+            m_pos++;
+        return optional;
+    }
+
+    /**
+     * Skip what follows the ( of a group, like ?: or ?<name>
+     *
+     * @return  - true for lookarounds, which don't match any text
+     **/
+    bool skipGroupFlags()
+    {
+        if (m_pos == m_pattern.size() || m_pattern[m_pos] != '?')
+            return false;
+        m_pos++;
+
+        if (m_pos < m_pattern.size() && (m_pattern[m_pos] == '=' || m_pattern[m_pos] == '!'))
+            return true;
+        if (m_pos + 1 < m_pattern.size() && m_pattern[m_pos] == '<'
+                && (m_pattern[m_pos + 1] == '=' || m_pattern[m_pos + 1] == '!'))
+            return true;
+
+        // Names and inline flags, up to where the group itself starts
+        if (m_pos < m_pattern.size() && (m_pattern[m_pos] == '<' || m_pattern[m_pos] == '\'' || m_pattern[m_pos] == 'P')) {
+            QChar close = m_pattern[m_pos] == '\'' ? '\'' : '>';
+            while (m_pos < m_pattern.size() && m_pattern[m_pos] != close)
+                m_pos++;
+            m_pos++;
+            return false;
+        }
+        while (m_pos < m_pattern.size() && m_pattern[m_pos] != ':' && m_pattern[m_pos] != ')') {
+            if (m_pattern[m_pos] == 'x')
+                m_extended = true;
+            m_pos++;
+        }
+        if (m_pos < m_pattern.size() && m_pattern[m_pos] == ':')
+            m_pos++;
+        return false;
+    }
+
+    /**
+     * Skip whatever follows an escape like \x or \p
+     *
+     * @param c - character following the backslash
+     **/
+    void skipEscape(QChar c)
+    {
+        static const QString braced("xopPgkN");
+        if (braced.contains(c) && m_pos < m_pattern.size()) {
+            QChar open = m_pattern[m_pos];
+            QChar close = open == '{' ? '}' : open == '<' ? '>' : open == '\'' ? '\'' : QChar();
+            if (!close.isNull()) {
+                while (m_pos < m_pattern.size() && m_pattern[m_pos] != close)
+                    m_pos++;
+                m_pos++;
+                return;
+            }
+        }
+
+        if (c == 'x') {
+            for (int i = 0; i < 2 && m_pos < m_pattern.size() && isxdigit(m_pattern[m_pos].unicode()); ++i)
+                m_pos++;
+        } else if (c == 'c' || c == 'p' || c == 'P' || c == 'g') {
+            if (m_pos < m_pattern.size())
+                m_pos++;
+        } else if (c.isDigit()) {
+            while (m_pos < m_pattern.size() && m_pattern[m_pos].isDigit())
+                m_pos++;
+        }
+    }
+
+    void skipClass()
+    {
+        // A ] right at the start is part of the class
+        if (m_pos < m_pattern.size() && m_pattern[m_pos] == '^')
+            m_pos++;
+        if (m_pos < m_pattern.size() && m_pattern[m_pos] == ']')
+            m_pos++;
+
+        while (m_pos < m_pattern.size() && m_pattern[m_pos] != ']') {
+            if (m_pattern[m_pos] == '\\')
+                m_pos++;
+            m_pos++;
+        }
+        m_pos++;
+    }
+
+    /**
+     * Keep whichever alternatives narrow things down the most, which is the
+     * ones whose shortest text is the longest
+     **/
+    static void consider(QStringList *best, const QStringList &text)
+    {
+        if (text.isEmpty() || text.contains(QString()))
+            return;
+        if (best->isEmpty() || shortest(text) > shortest(*best)
+                || (shortest(text) == shortest(*best) && text.size() < best->size()))
+            *best = text;
+    }
+
+    static int shortest(const QStringList &text)
+    {
+        int len = std::numeric_limits<int>::max();
+        for (const auto &s : text)
+            len = std::min(len, s.size());
+        return len;
+    }
+
+    const QString &m_pattern;
+    int m_pos{0};
+    bool m_unbalanced{false};
+    bool m_extended{false};
+};
+
+void appendChars(QString *text, std::vector<int> *cols, const uint32_t *chars, int col)
+{
+    if (chars[0] == PackedCell::Continuation)
+        return;
+
+    if (!chars[0]) {
+        text->append(' ');
+        cols->push_back(col);
+        return;
+    }
+
+    for (int i = 0; i < VTERM_MAX_CHARS_PER_CELL && chars[i]; ++i) {
+        if (QChar::requiresSurrogates(chars[i])) {
+            text->append(QChar(QChar::highSurrogate(chars[i])));
+            text->append(QChar(QChar::lowSurrogate(chars[i])));
+            cols->insert(cols->end(), 2, col);
+        } else {
+            text->append(QChar(static_cast<int>(chars[i])));
+            cols->push_back(col);
+        }
+    }
+}
+} // namespace
+
+Search::Search(const QRegularExpression &regexp, const std::function<void(int, int, std::vector<VTermScreenCell> *)> &fetchRows, const QSize &size, const std::vector<bool> &continued, const Scrollback *scrollback) :
+    m_regexp(regexp)
+{
+    qRegisterMetaType<QVector<SearchMatch>>();
+
+    if (scrollback) {
+        m_snapshot = scrollback->snapshot();
+        m_filter = scrollback->filter(requiredText(regexp));
+    }
+
+    std::vector<VTermScreenCell> cells{};
+    fetchRows(0, size.height(), &cells);
+
+    for (int y = 0; y < size.height(); ++y) {
+        // Only join rows known to have wrapped, and the top one only with a
+        // scrollback to join it to
+        auto row = static_cast<size_t>(y);
+        bool joined = row < continued.size() && continued[row] && (y || (scrollback && scrollback->size()));
+        Text text{m_snapshot.serial() + static_cast<uint64_t>(y), joined, {}, {}};
+        const VTermScreenCell *cell = &cells[static_cast<size_t>(y * size.width())];
+
+        int ncells = size.width();
+        for (; ncells > 0; --ncells) {
+            if (cell[ncells - 1].chars[0])
+                break;
+        }
+
+        for (int x = 0; x < ncells; ++x)
+            appendChars(&text.text, &text.cols, cell[x].chars, x);
+
+        m_screen.push_back(std::move(text));
+    }
+}
+
+QStringList Search::requiredText(const QRegularExpression &regexp)
+{
+    // Whitespace and comments would be taken for literal text
+    if (regexp.patternOptions() & QRegularExpression::ExtendedPatternSyntaxOption)
+        return {};
+
+    return RequiredText(regexp.pattern()).parse();
+}
+
+Search::~Search()
+{
+    requestInterruption();
+    wait();
+}
+
+void Search::run()
+{
+    m_sinceReport.start();
+
+    for (auto row = m_screen.rbegin(); row != m_screen.rend(); ++row) {
+        if (!feed(std::move(*row)))
+            return;
+    }
+
+    auto visit = [this](uint64_t seq, const ScrollbackLine &sbl) {
+        Text line{seq, sbl.continued(), {}, {}};
+        for (int col = 0; col < sbl.ncells(); ++col)
+            appendChars(&line.text, &line.cols, sbl.chars(sbl.cell(col)).data(), col);
+        return feed(std::move(line));
+    };
+    if (!m_snapshot.visit(visit, m_filter))
+        return;
+
+    // The oldest line may have been the remainder of a dropped one
+    if (!m_group.empty())
+        searchGroup();
+    report(true);
+}
+
+bool Search::feed(Text &&text)
+{
+    if (isInterruptionRequested())
+        return false;
+
+    // Lines were skipped by the filter, whatever came before them can't be
+    // joined with what comes after.
+    if (!m_group.empty() && m_group.back().line != text.line + 1)
+        searchGroup();
+
+    bool continued = text.continued;
+    m_group.push_back(std::move(text));
+    if (!continued) {
+        searchGroup();
+        report(false);
+    }
+    return true;
+}
+
+void Search::searchGroup()
+{
+    QString text;
+    std::vector<std::pair<uint64_t, int>> pos;
+    for (auto line = m_group.rbegin(); line != m_group.rend(); ++line) {
+        text.append(line->text);
+        for (int col : line->cols)
+            pos.emplace_back(line->line, col);
+    }
+    m_group.clear();
+
+    std::vector<SearchMatch> found;
+    auto it = m_regexp.globalMatch(text);
+    while (it.isValid() && it.hasNext()) {
+        auto match = it.next();
+        if (!match.capturedLength())
+            continue;
+
+        const auto &start = pos[static_cast<size_t>(match.capturedStart())];
+        const auto &end = pos[static_cast<size_t>(match.capturedEnd() - 1)];
+        found.push_back({start.first, start.second, end.first, end.second});
+    }
+
+    // Newest first, so right to left within the group
+    for (auto match = found.rbegin(); match != found.rend(); ++match)
+        m_found.append(*match);
+}
+
+void Search::report(bool done)
+{
+    if (m_found.isEmpty())
+        return;
+
+    // The first match goes out right away, the rest are batched up
+    if (!done && m_reported && m_sinceReport.elapsed() < reportInterval)
+        return;
+
+    emit matched(m_found);
+    m_found.clear();
+    m_reported = true;
+    m_sinceReport.restart();
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "scrollback.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <QElapsedTimer>
+#include <QMetaType>
+#include <QRegularExpression>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+
+extern "C" {
+#include <vterm.h>
+}
+
+/**
+ * Position of a match, end inclusive.  Lines are numbered by scrollback
+ * sequence number and the rows of the screen follow the newest scrollback
+ * line, see Search::screenLine().
+ **/
+struct SearchMatch {
+    uint64_t startLine;
+    int startCol;
+    uint64_t endLine;
+    int endCol;
+};
+Q_DECLARE_METATYPE(SearchMatch)
+
+/**
+ * Expression for finding URLs, use with
+ * QRegularExpression::CaseInsensitiveOption and
+ * QRegularExpression::DotMatchesEverythingOption.
+ **/
+// clang-format off
+constexpr const char *urlMatch =
+    R"((?:https?://|ftp://|news://|mailto:|file://|\bwww\.))"
+    R"([\w\-\@;\/?:&=%\$.+!*\x27,~#]*)"
+    "("
+        R"(\([\w\-\@;\/?:&=%\$.+!*\x27,~#]*\))"
+        "|"
+        R"([\w\-\@;\/?:&=%\$+*~])"
+    ")+";
+// clang-format on
+
+/**
+ * Regular expression search over the screen and the scrollback, run on its own
+ * thread.
+ *
+ * The screen and a snapshot of the scrollback are taken when the Search is
+ * created so the terminal can carry on while it runs.  Matches are reported
+ * through matched() in batches as they are found, starting from the bottom of
+ * the screen.  Destroying the Search cancels it.
+ *
+ * When every match has to contain some literal text, the trigram index of the
+ * scrollback is used to skip over lines which can't contain it.
+ **/
+class Search : public QThread {
+    Q_OBJECT
+public:
+    /**
+     * Create a new search, call start() to run it
+     *
+     * @param regexp        - Regular expression to search for
+     * @param fetchRows     - Function filling in the cells of the screen rows
+     *                        from start up to end, size.width() cells per row
+     * @param size          - Size of the screen
+     * @param continued     - Whether each screen row carries on from the one
+     *                        above, the top one from the newest scrollback line
+     * @param scrollback    - Scrollback to search or nullptr for none
+     **/
+    Search(const QRegularExpression &regexp, const std::function<void(int, int, std::vector<VTermScreenCell> *)> &fetchRows, const QSize &size, const std::vector<bool> &continued, const Scrollback *scrollback);
+    ~Search() override;
+
+    const QRegularExpression &regexp() const { return m_regexp; };
+
+    /**
+     * Line number of the top row of the screen
+     **/
+    uint64_t screenLine() const { return m_snapshot.serial(); };
+
+    /**
+     * Find the literal text every match of an expression contains
+     *
+     * @param regexp    - expression to look at
+     *
+     * @return  - alternatives one of which is part of every match, or nothing
+     *            if the expression doesn't tell
+     **/
+    static QStringList requiredText(const QRegularExpression &regexp);
+
+signals:
+    void matched(QVector<SearchMatch> matches);
+
+protected:
+    void run() override;
+
+private:
+    /**
+     * Text of a single row or scrollback line and the column each QChar came
+     * from.
+     **/
+    struct Text {
+        uint64_t line;
+        bool continued;
+        QString text;
+        std::vector<int> cols;
+    };
+
+    bool feed(Text &&text);
+    void searchGroup();
+    void report(bool done);
+
+    QRegularExpression m_regexp;
+    ScrollbackSnapshot m_snapshot;
+    LineFilter m_filter;
+
+    // Rows of the screen, top to bottom
+    std::vector<Text> m_screen;
+
+    // Lines wrapped into one, newest first
+    std::vector<Text> m_group;
+
+    QVector<SearchMatch> m_found;
+    QElapsedTimer m_sinceReport;
+    bool m_reported{false};
+};
@@ -0,0 +1,125 @@
+#include "spillfile.hpp"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+// Smallest mapping to create, the file is sparse so this costs nothing
+constexpr size_t minMap = 16 << 20;
+} // namespace
+
+SpillFile::~SpillFile()
+{
+    if (m_map)
+        munmap(m_map, m_mapped);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool SpillFile::open()
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !dir[0])
+        dir = "/tmp";
+
+    m_fd = ::open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (m_fd < 0) {
+        // Not every filesystem supports O_TMPFILE
+        std::string path = std::string(dir) + "/sff-scrollback-XXXXXX";
+        m_fd = mkostemp(&path[0], O_CLOEXEC);
+        if (m_fd >= 0)
+            unlink(path.c_str());
+    }
+
+    if (m_fd < 0) {
+        qWarning("scrollback spill file in %s: %s", dir, strerror(errno));
+        return false;
+    }
+
+    return map(minMap);
+}
+
+int64_t SpillFile::append(const char *data, size_t len)
+{
+    if (m_fd < 0)
+        return -1;
+
+    if (m_size + len > m_mapped && !map(std::max(m_mapped * 2, m_size + len)))
+        return -1;
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(m_fd, data + written, len - written, static_cast<off_t>(m_size + written));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            qWarning("write to scrollback spill file: %s", strerror(errno));
+            return -1;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    auto offset = static_cast<int64_t>(m_size);
+    m_size += len;
+    return offset;
+}
+
+QByteArray SpillFile::read(uint64_t offset, size_t len) const
+{
+    QByteArray buf(static_cast<int>(len), Qt::Uninitialized);
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(m_fd, buf.data() + done, len - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            qWarning("read from scrollback spill file: %s", n < 0 ? strerror(errno) : "short read");
+            return {};
+        }
+        done += static_cast<size_t>(n);
+    }
+
+    return buf;
+}
+
+void SpillFile::release(uint64_t offset, size_t len)
+{
+    if (m_fd < 0)
+        return;
+
+    fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(len));
+}
+
+bool SpillFile::map(size_t len)
+{
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    len = std::max(len, minMap);
+    len = (len + page - 1) / page * page;
+
+    if (ftruncate(m_fd, static_cast<off_t>(len)) < 0) {
+        qWarning("resize scrollback spill file: %s", strerror(errno));
+        return false;
+    }
+
+    void *p = m_map
+            ? mremap(m_map, m_mapped, len, MREMAP_MAYMOVE)
+            : mmap(nullptr, len, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+        qWarning("map scrollback spill file: %s", strerror(errno));
+        return false;
+    }
+
+    m_map = static_cast<char *>(p);
+    m_mapped = len;
+    return true;
+}
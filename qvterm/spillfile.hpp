@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <QByteArray>
+
+/**
+ * Unlinked temporary file holding data that should not count against memory.
+ *
+ * Data is appended with write(2) and read back through a shared mapping of the
+ * file, so only the pages that are actually read end up resident.  The file
+ * lives in XDG_RUNTIME_DIR and is unlinked as soon as it is created so that
+ * nothing is left behind, even if we crash.
+ **/
+class SpillFile {
+public:
+    SpillFile() = default;
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+    ~SpillFile();
+
+    /**
+     * Create the backing file
+     *
+     * @return  - true on success, false otherwise
+     **/
+    bool open();
+
+    /**
+     * Append data to the file
+     *
+     * @param data  - data to append
+     * @param len   - length of data
+     *
+     * @return  - offset the data was written at or -1 on failure
+     **/
+    int64_t append(const char *data, size_t len);
+
+    /**
+     * Access previously appended data
+     *
+     * @param offset    - offset returned by append()
+     *
+     * @return  - pointer to the data, valid until the next call to append()
+     **/
+    const char *data(uint64_t offset) const { return m_map + offset; };
+
+    /**
+     * Copy previously appended data.  Unlike data(), this is safe to call from
+     * any thread while the file is being appended to.
+     *
+     * @param offset    - offset returned by append()
+     * @param len       - length of data
+     *
+     * @return  - copy of the data or an empty array on failure
+     **/
+    QByteArray read(uint64_t offset, size_t len) const;
+
+    /**
+     * Give the disk space backing previously appended data back.  The data may
+     * not be accessed afterwards.
+     *
+     * @param offset    - offset returned by append()
+     * @param len       - length of data
+     **/
+    void release(uint64_t offset, size_t len);
+
+    /**
+     * Bytes appended over the lifetime of the file
+     **/
+    size_t size() const { return m_size; };
+
+private:
+    bool map(size_t len);
+
+    int m_fd{-1};
+    char *m_map{nullptr};
+    size_t m_mapped{0};
+    size_t m_size{0};
+};
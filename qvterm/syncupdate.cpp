@@ -0,0 +1,97 @@
+#include "syncupdate.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// Markers and queries up to the final bytes, h or l to set or reset the mode
+// and $p to ask for it
+const char prefix[] = "\x1b[?2026";
+const size_t prefixLen = sizeof(prefix) - 1;
+} // namespace
+
+void SyncUpdate::write(VTerm *vterm, const char *data, size_t len, const std::function<void(const char *, size_t)> &reply)
+{
+    size_t done = 0;
+    while (done < len) {
+        done += scan(data + done, len - done, &m_feed, &m_reply);
+        vterm_input_write(vterm, m_feed.constData(), static_cast<size_t>(m_feed.size()));
+        if (!m_reply.isEmpty())
+            reply(m_reply.constData(), static_cast<size_t>(m_reply.size()));
+    }
+}
+
+size_t SyncUpdate::scan(const char *data, size_t len, QByteArray *feed, QByteArray *reply)
+{
+    feed->clear();
+    reply->clear();
+
+    qint64 since = m_since;
+    const char *end = data + len;
+    const char *p = data;
+    while (p < end) {
+        // Most output has nothing to do with synchronized updates
+        if (!m_matched) {
+            auto *esc = static_cast<const char *>(memchr(p, prefix[0], static_cast<size_t>(end - p)));
+            const char *stop = esc ? esc : end;
+            feed->append(p, static_cast<int>(stop - p));
+            p = stop;
+            if (p == end)
+                break;
+        }
+
+        char c = *p;
+        if (m_matched < prefixLen) {
+            if (c == prefix[m_matched]) {
+                m_matched++;
+                p++;
+                continue;
+            }
+        } else if (m_matched == prefixLen) {
+            if (c == 'h' || c == 'l') {
+                if (c == 'h' && since < 0)
+                    since = m_clock.elapsed();
+                else if (c == 'l')
+                    since = -1;
+
+                // libvterm ignores them, but they might as well go through
+                feed->append(prefix, prefixLen);
+                feed->append(c);
+                m_matched = 0;
+                p++;
+                continue;
+            }
+            if (c == '$') {
+                m_matched++;
+                p++;
+                continue;
+            }
+        } else if (c == 'p') {
+            // DECRPM, the mode is set during an update and reset otherwise
+            reply->append(since >= 0 ? "\x1b[?2026;1$y" : "\x1b[?2026;2$y");
+            m_matched = 0;
+            p++;
+            break;
+        }
+
+        // Something else after all, pass on what was held back and look at
+        // this byte again, it may start another marker
+        feed->append(prefix, static_cast<int>(std::min(m_matched, prefixLen)));
+        if (m_matched > prefixLen)
+            feed->append('$');
+        m_matched = 0;
+    }
+
+    m_since = since;
+    return static_cast<size_t>(p - data);
+}
+
+int SyncUpdate::holdFor(int timeout) const
+{
+    qint64 since = m_since;
+    if (!m_enabled || since < 0)
+        return 0;
+
+    qint64 left = since + timeout - m_clock.elapsed();
+    return left > 0 ? static_cast<int>(left) : 0;
+}
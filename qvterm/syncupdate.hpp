@@ -0,0 +1,93 @@
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+extern "C" {
+#include <vterm.h>
+}
+
+/**
+ * Follows synchronized updates (DEC private mode 2026), where an app brackets
+ * a redraw with CSI ? 2026 h and CSI ? 2026 l so that it's only shown once it
+ * is complete.
+ *
+ * libvterm drops private modes it doesn't know, so the markers are picked out
+ * of the output as it is fed to libvterm.  The mode is taken to be whatever
+ * the last marker in the data set it to, which doesn't hold anything back
+ * when an update starts and ends within the same read.  Apps check for
+ * support by asking for the mode with DECRQM, those queries are answered here
+ * and never reach libvterm, which would report the mode as unknown.
+ *
+ * Data is scanned on the parsing thread with the lock on the terminal held,
+ * the GUI thread only asks whether frames are being held back.
+ **/
+class SyncUpdate {
+public:
+    SyncUpdate() { m_clock.start(); }
+
+    /**
+     * Feed data to libvterm, following the mode on the way
+     *
+     * @param vterm - terminal to feed
+     * @param data  - output of the PTY
+     * @param len   - bytes of data
+     * @param reply - called with answers to queries for the mode, in order
+     *                with whatever libvterm writes back
+     **/
+    void write(VTerm *vterm, const char *data, size_t len, const std::function<void(const char *, size_t)> &reply);
+
+    /**
+     * Look for markers and queries in data about to be fed to libvterm, up
+     * to and including the first query
+     *
+     * @param data  - output of the PTY
+     * @param len   - bytes of data
+     * @param feed  - set to what should be fed to libvterm.  Queries are left
+     *                out and the start of a marker split over two reads is
+     *                held back until the rest of it arrives.
+     * @param reply - set to the answer to the query, if there was one
+     *
+     * @return  - bytes of data scanned
+     **/
+    size_t scan(const char *data, size_t len, QByteArray *feed, QByteArray *reply);
+
+    /**
+     * True while an update is in progress, even if it ran out of time or
+     * holding frames back is disabled
+     **/
+    bool active() const { return m_since >= 0; }
+
+    /**
+     * Milliseconds to hold frames back for
+     *
+     * @param timeout   - Longest an update is waited for
+     *
+     * @return  - 0 if frames should be shown now
+     **/
+    int holdFor(int timeout) const;
+
+    /**
+     * Choose whether frames are held back during updates, for comparing
+     * frames painted with and without them
+     **/
+    void setEnabled(bool enabled) { m_enabled = enabled; }
+
+private:
+    QElapsedTimer m_clock{};
+
+    // Milliseconds on m_clock when the update started, -1 outside of one
+    std::atomic<qint64> m_since{-1};
+    std::atomic<bool> m_enabled{true};
+
+    // Length of the marker or query matched at the end of the last scan
+    size_t m_matched{0};
+
+    QByteArray m_feed{};
+    QByteArray m_reply{};
+};
@@ -0,0 +1,212 @@
+#include "trigramindex.hpp"
+
+#include <QtAlgorithms>
+
+#include <algorithm>
+
+namespace {
+// Bits of the group being added to, enough for most of the trigrams of 256
+// lines of 200 columns to get bits of their own
+constexpr size_t openBits = 1 << 17;
+
+// Smallest bitmap a group is folded down to
+constexpr size_t minBits = 1 << 9;
+
+// Bits per bit set in a folded group, with two set for each trigram that's
+// about 8 bits per trigram, and a trigram of a query is then found in a group
+// not containing it about 1 in 20 times
+constexpr size_t bitsPerSet = 4;
+
+uint32_t fold(uint32_t c)
+{
+    if (c < 0x80)
+        return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    return QChar::toCaseFolded(c);
+}
+} // namespace
+
+TrigramIndex::Trigram TrigramIndex::trigram(uint32_t a, uint32_t b, uint32_t c)
+{
+    // Code points fit in 21 bits, so no two trigrams share a key, and the
+    // splitmix64 finalizer spreads them over the low bits groups look at
+    uint64_t h = uint64_t(a) | uint64_t(b) << 21 | uint64_t(c) << 42;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    // Two bits per trigram, so a trigram missing from a group only gets
+    // through when other trigrams set both.  They're in the same word, which
+    // keeps a lookup to one cache miss.
+    return {static_cast<size_t>(h), uint64_t(1) << (h >> 52 & 63) | uint64_t(1) << (h >> 58)};
+}
+
+bool TrigramIndex::Group::test(const Trigram &trigram) const
+{
+    return (bits[trigram.word & (bits.size() - 1)] & trigram.bits) == trigram.bits;
+}
+
+void TrigramIndex::Group::set(const Trigram &trigram)
+{
+    bits[trigram.word & (bits.size() - 1)] |= trigram.bits;
+}
+
+bool LineFilter::wanted(uint64_t first, uint64_t last) const
+{
+    if (m_all)
+        return true;
+
+    for (uint64_t group = first / TrigramIndex::groupLines; group <= last / TrigramIndex::groupLines; ++group) {
+        // Lines the index didn't know about can't be ruled out
+        if (group < m_first || group - m_first >= m_groups.size())
+            return true;
+        if (m_groups[group - m_first])
+            return true;
+    }
+    return false;
+}
+
+void TrigramIndex::add(uint64_t seq, bool continued, const uint32_t *chars, size_t len)
+{
+    uint64_t group = seq / groupLines;
+    if (m_groups.empty())
+        m_first = group;
+    if (group < m_first)
+        return;
+    while (group - m_first >= m_groups.size()) {
+        if (!m_groups.empty())
+            seal(&m_groups.back());
+        m_groups.push_back({std::vector<uint64_t>(openBits / 64), false});
+        m_bitsBytes += openBits / 8;
+    }
+
+    Group &g = m_groups[group - m_first];
+    if (seq % groupLines == 0)
+        g.joined = continued;
+
+    // Lines that have since been popped leave their bits behind, which only
+    // costs a false positive now and then.
+    std::array<uint32_t, 3> window{};
+    size_t n = 0;
+    if (continued) {
+        std::copy_n(m_tail.begin(), m_tailLen, window.begin());
+        n = m_tailLen;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        if (n == window.size()) {
+            window[0] = window[1];
+            window[1] = window[2];
+            n--;
+        }
+        window[n++] = fold(chars[i]);
+
+        if (n == window.size())
+            g.set(trigram(window[0], window[1], window[2]));
+    }
+
+    m_tailLen = std::min<size_t>(n, m_tail.size());
+    std::copy_n(window.begin() + (n - m_tailLen), m_tailLen, m_tail.begin());
+}
+
+void TrigramIndex::prune(uint64_t oldest)
+{
+    while (!m_groups.empty() && (m_first + 1) * groupLines <= oldest) {
+        m_bitsBytes -= m_groups.front().bits.size() * sizeof(uint64_t);
+        m_groups.pop_front();
+        m_first++;
+    }
+}
+
+void TrigramIndex::seal(Group *group)
+{
+    size_t words = group->bits.size();
+    size_t set = 0;
+    for (uint64_t word : group->bits)
+        set += qPopulationCount(word);
+
+    // Folding the top half onto the bottom one keeps every trigram in the
+    // word picked by the low bits of its hash.  Stops at the power of two
+    // nearest the target size.
+    size_t target = std::max(minBits, set * bitsPerSet) / 64;
+    while (words * 2 >= target * 3) {
+        words /= 2;
+        for (size_t i = 0; i < words; ++i)
+            group->bits[i] |= group->bits[i + words];
+    }
+    if (words == group->bits.size())
+        return;
+
+    m_bitsBytes -= (group->bits.size() - words) * sizeof(uint64_t);
+    group->bits.resize(words);
+    group->bits.shrink_to_fit();
+}
+
+LineFilter TrigramIndex::query(const QString &text) const
+{
+    auto chars = text.toUcs4();
+    return query(chars.constData(), static_cast<size_t>(chars.size()));
+}
+
+LineFilter TrigramIndex::query(const QStringList &text) const
+{
+    LineFilter filter;
+    for (const auto &s : text) {
+        LineFilter alternative = query(s);
+        if (alternative.m_all)
+            return alternative;
+
+        if (filter.m_all) {
+            filter = std::move(alternative);
+            continue;
+        }
+        for (size_t i = 0; i < filter.m_groups.size(); ++i) {
+            if (alternative.m_groups[i])
+                filter.m_groups[i] = true;
+        }
+    }
+    return filter;
+}
+
+LineFilter TrigramIndex::query(const uint32_t *chars, size_t len) const
+{
+    LineFilter filter;
+    if (len < 3 || m_groups.empty())
+        return filter;
+
+    std::vector<Trigram> trigrams;
+    for (size_t i = 2; i < len; ++i)
+        trigrams.push_back(trigram(fold(chars[i - 2]), fold(chars[i - 1]), fold(chars[i])));
+
+    filter.m_all = false;
+    filter.m_first = m_first;
+    filter.m_groups.resize(m_groups.size());
+
+    // A line wrapped across groups may have its trigrams spread over all of
+    // them, so groups joined that way are tested together.
+    std::vector<const Group *> run;
+    size_t start = 0;
+    while (start < m_groups.size()) {
+        size_t end = start + 1;
+        while (end < m_groups.size() && m_groups[end].joined)
+            end++;
+
+        run.clear();
+        for (size_t i = start; i < end; ++i)
+            run.push_back(&m_groups[i]);
+
+        bool found = std::all_of(trigrams.begin(), trigrams.end(), [&](const Trigram &t) {
+            for (const Group *g : run) {
+                if (g->test(t))
+                    return true;
+            }
+            return false;
+        });
+
+        std::fill(filter.m_groups.begin() + static_cast<long>(start), filter.m_groups.begin() + static_cast<long>(end), found);
+        start = end;
+    }
+
+    return filter;
+}
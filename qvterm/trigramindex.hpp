@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <QString>
+#include <QStringList>
+
+/**
+ * Lines picked out by TrigramIndex::query(), in groups of
+ * TrigramIndex::groupLines.
+ **/
+class LineFilter {
+public:
+    /**
+     * Create a filter which lets every line through
+     **/
+    LineFilter() = default;
+
+    /**
+     * Test whether any of a range of lines is let through
+     *
+     * @param first - sequence number of the first line
+     * @param last  - sequence number of the last line
+     **/
+    bool wanted(uint64_t first, uint64_t last) const;
+
+private:
+    friend class TrigramIndex;
+
+    bool m_all{true};
+    uint64_t m_first{0};
+    std::vector<bool> m_groups;
+};
+
+/**
+ * Index of the trigrams found in each group of lines.
+ *
+ * Each group has a bitmap with two bits set for every trigram hashed into it,
+ * so if any bit of a query is missing the group can't contain it.  The group
+ * being added to has a large bitmap, once it is complete that is folded down
+ * to a size in proportion to the number of distinct trigrams it holds, which
+ * keeps both repetitive and varied output from filling it up.  Text is case
+ * folded first, which keeps the index usable for case insensitive searches.
+ **/
+class TrigramIndex {
+public:
+    static constexpr uint64_t groupLines = 256;
+
+    /**
+     * Add a line
+     *
+     * @param seq       - sequence number of the line
+     * @param continued - true if the line wrapped from the one added before it
+     * @param chars     - characters of the line
+     * @param len       - number of characters
+     **/
+    void add(uint64_t seq, bool continued, const uint32_t *chars, size_t len);
+
+    /**
+     * Forget groups made up entirely of lines older than oldest
+     *
+     * @param oldest    - sequence number of the oldest line still around
+     **/
+    void prune(uint64_t oldest);
+
+    /**
+     * Find the groups which may contain some text
+     *
+     * @param text  - literal text to look for
+     *
+     * @return  - filter letting only those groups through, or everything if
+     *            the text is too short to narrow anything down.
+     **/
+    LineFilter query(const QString &text) const;
+    LineFilter query(const uint32_t *chars, size_t len) const;
+
+    /**
+     * Find the groups which may contain any of several texts
+     *
+     * @param text  - alternatives to look for, an empty list narrows nothing
+     *                down
+     **/
+    LineFilter query(const QStringList &text) const;
+
+    size_t bytes() const { return m_groups.size() * sizeof(Group) + m_bitsBytes; };
+
+private:
+    // Where a trigram goes in the bitmap of a group
+    struct Trigram {
+        // Word, before taking it modulo the size of the bitmap
+        size_t word;
+        uint64_t bits;
+    };
+
+    struct Group {
+        // Size is a power of two, trigrams are looked up by the low bits of
+        // their hash
+        std::vector<uint64_t> bits;
+
+        // First line wrapped from the last line of the previous group
+        bool joined;
+
+        bool test(const Trigram &trigram) const;
+        void set(const Trigram &trigram);
+    };
+
+    static Trigram trigram(uint32_t a, uint32_t b, uint32_t c);
+
+    /**
+     * Fold the bitmap of a complete group down to its final size
+     **/
+    void seal(Group *group);
+
+    std::deque<Group> m_groups;
+    uint64_t m_first{0};
+    size_t m_bitsBytes{0};
+
+    // End of the last line added, for trigrams spanning a wrap
+    std::array<uint32_t, 2> m_tail{};
+    size_t m_tailLen{0};
+};
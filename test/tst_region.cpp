@@ -0,0 +1,59 @@
+#include <QtTest>
+
+#include <region.hpp>
+
+#include <vector>
+
+namespace {
+constexpr int cols = 4;
+
+// Rows of "abcd", "efgh", "ijkl" and so on
+void fetchRows(int start, int end, std::vector<VTermScreenCell> *cells)
+{
+    cells->assign(static_cast<size_t>((end - start) * cols), VTermScreenCell{});
+    for (int y = start; y < end; ++y) {
+        for (int x = 0; x < cols; ++x) {
+            VTermScreenCell &cell = (*cells)[static_cast<size_t>((y - start) * cols + x)];
+            cell.chars[0] = static_cast<uint32_t>('a' + y * cols + x);
+            cell.width = 1;
+        }
+    }
+}
+} // namespace
+
+class TestRegion : public QObject {
+    Q_OBJECT
+
+private slots:
+    void dumpPastLastColumn();
+    void dumpStringPastLastColumn();
+    void dumpStringOnlyPastLastColumn();
+};
+
+void TestRegion::dumpPastLastColumn()
+{
+    QSize termSize{cols, 3};
+
+    // Dragging over the scrollbar ends the selection past the last column
+    QCOMPARE(Region({1, 0}, {9, 1}).dump(termSize, fetchRows), QString("bcdefgh"));
+    QCOMPARE(Region({2, 2}, {9, 2}).dump(termSize, fetchRows), QString("kl"));
+}
+
+void TestRegion::dumpStringPastLastColumn()
+{
+    QSize termSize{cols, 3};
+
+    QCOMPARE(Region({1, 0}, {9, 1}).dumpString(termSize, fetchRows), QString("bcdefgh"));
+    QCOMPARE(Region({2, 2}, {9, 2}).dumpString(termSize, fetchRows), QString("kl"));
+}
+
+void TestRegion::dumpStringOnlyPastLastColumn()
+{
+    QSize termSize{cols, 3};
+
+    // Nothing of the first row is selected, only its end
+    QCOMPARE(Region({6, 0}, {1, 1}).dumpString(termSize, fetchRows), QString("\nef"));
+}
+
+QTEST_APPLESS_MAIN(TestRegion)
+#include "tst_region.moc"
@@ -0,0 +1,219 @@
+#include <QtTest>
+
+#include <palette.hpp>
+#include <scrollback.hpp>
+
+#include <cstring>
+#include <vector>
+
+namespace {
+constexpr int cols = 20;
+
+// Every line gets colors of its own, and every other one a combining
+// character
+void fillLine(VTermScreenCell *cells, uint32_t n)
+{
+    memset(cells, 0, sizeof(VTermScreenCell) * cols);
+    for (int i = 0; i < cols; ++i) {
+        cells[i].chars[0] = static_cast<uint32_t>('a' + i);
+        cells[i].width = 1;
+        vterm_color_rgb(&cells[i].fg, static_cast<uint8_t>(n), static_cast<uint8_t>(n >> 8), static_cast<uint8_t>(i));
+        vterm_color_rgb(&cells[i].bg, 0, 0, 0);
+        cells[i].attrs.bold = n % 3 == 0;
+    }
+    if (n % 2)
+        cells[0].chars[1] = 0x301;
+}
+
+bool sameCell(const VTermScreenCell &a, const VTermScreenCell &b)
+{
+    return a.chars[0] == b.chars[0] && a.chars[1] == b.chars[1]
+            && vterm_color_is_equal(&a.fg, &b.fg) && vterm_color_is_equal(&a.bg, &b.bg)
+            && a.attrs.bold == b.attrs.bold;
+}
+} // namespace
+
+class TestScrollback : public QObject {
+    Q_OBJECT
+
+private slots:
+    void stylesSurviveCompression();
+    void stylesSurvivePop();
+    void popBlankLines();
+    void rewrapOnlyWrapped();
+    void tablesReclaimed();
+    void budget();
+};
+
+void TestScrollback::stylesSurviveCompression()
+{
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+
+    constexpr uint32_t lines = 5000;
+    Scrollback scrollback(lines, 100);
+    std::vector<VTermScreenCell> cells(cols);
+    for (uint32_t n = 0; n < lines; ++n) {
+        fillLine(cells.data(), n);
+        scrollback.emplace(cols, cells.data(), palette, false);
+    }
+
+    for (uint32_t n = 0; n < lines; n += 7) {
+        fillLine(cells.data(), n);
+        for (int col = 0; col < cols; ++col) {
+            const VTermScreenCell *cell = scrollback.cell(lines - 1 - n, col);
+            QVERIFY(cell);
+            QVERIFY(sameCell(*cell, cells[static_cast<size_t>(col)]));
+        }
+    }
+
+    vterm_free(vterm);
+}
+
+void TestScrollback::stylesSurvivePop()
+{
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+
+    constexpr uint32_t lines = 1000;
+    Scrollback scrollback(lines, 10);
+    std::vector<VTermScreenCell> cells(cols);
+    for (uint32_t n = 0; n < lines; ++n) {
+        fillLine(cells.data(), n);
+        scrollback.emplace(cols, cells.data(), palette, false);
+    }
+
+    // Popping lines brings compressed blocks back into the scrollback tables
+    std::vector<VTermScreenCell> expected(cols);
+    for (uint32_t n = lines; n-- > 0;) {
+        fillLine(expected.data(), n);
+        scrollback.popto(cols, cells.data());
+        for (size_t col = 0; col < cols; ++col)
+            QVERIFY(sameCell(cells[col], expected[col]));
+    }
+    QCOMPARE(scrollback.size(), size_t(0));
+
+    vterm_free(vterm);
+}
+
+void TestScrollback::popBlankLines()
+{
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+
+    // Blank lines take no cells, so nothing ever allocates the arena
+    Scrollback scrollback(100, 10);
+    std::vector<VTermScreenCell> cells(cols);
+    for (int n = 0; n < 3; ++n) {
+        memset(cells.data(), 0, sizeof(VTermScreenCell) * cols);
+        for (auto &cell : cells)
+            cell.width = 1;
+        scrollback.emplace(cols, cells.data(), palette, false);
+    }
+
+    for (int n = 0; n < 3; ++n) {
+        scrollback.popto(cols, cells.data());
+        for (const auto &cell : cells)
+            QCOMPARE(cell.chars[0], uint32_t(0));
+    }
+    QCOMPARE(scrollback.size(), size_t(0));
+
+    vterm_free(vterm);
+}
+
+void TestScrollback::rewrapOnlyWrapped()
+{
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+
+    auto fill = [](VTermScreenCell *cells, uint32_t ch, int n) {
+        memset(cells, 0, sizeof(VTermScreenCell) * cols);
+        for (int i = 0; i < cols; ++i)
+            cells[i].width = 1;
+        for (int i = 0; i < n; ++i)
+            cells[i].chars[0] = ch;
+    };
+
+    // A full width separator followed by a prompt, then a line that did wrap
+    Scrollback scrollback(100, 10);
+    std::vector<VTermScreenCell> cells(cols);
+    fill(cells.data(), '=', cols);
+    scrollback.emplace(cols, cells.data(), palette, false);
+    fill(cells.data(), '$', 1);
+    scrollback.emplace(cols, cells.data(), palette, false);
+    fill(cells.data(), 'a', cols);
+    scrollback.emplace(cols, cells.data(), palette, true);
+    fill(cells.data(), 'b', 1);
+    scrollback.emplace(cols, cells.data(), palette, false);
+
+    scrollback.setWidth(cols * 2);
+    QCOMPARE(scrollback.rows(10), size_t(3));
+    QCOMPARE(scrollback.rowCell(0, cols)->chars[0], uint32_t('b'));
+    QCOMPARE(scrollback.rowCell(1, 0)->chars[0], uint32_t('$'));
+    QCOMPARE(scrollback.rowCell(2, 0)->chars[0], uint32_t('='));
+    QCOMPARE(scrollback.rowCell(2, cols)->chars[0], uint32_t(0));
+
+    // Popping the remainder of the wrapped line keeps the rest joinable
+    scrollback.popto(cols, cells.data());
+    fill(cells.data(), 'c', 1);
+    scrollback.emplace(cols, cells.data(), palette, false);
+    QCOMPARE(scrollback.rows(10), size_t(3));
+    QCOMPARE(scrollback.rowCell(0, cols)->chars[0], uint32_t('c'));
+
+    vterm_free(vterm);
+}
+
+void TestScrollback::tablesReclaimed()
+{
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+
+    // Styles of dropped lines go away along with them
+    constexpr uint32_t lines = 2048;
+    Scrollback scrollback(lines, 256);
+    std::vector<VTermScreenCell> cells(cols);
+    size_t bytes = 0;
+    for (uint32_t n = 0; n < lines * 16; ++n) {
+        fillLine(cells.data(), n);
+        scrollback.emplace(cols, cells.data(), palette, false);
+        if (n == lines * 2)
+            bytes = scrollback.usage().bytes;
+    }
+    QVERIFY(scrollback.usage().bytes < bytes * 2);
+
+    vterm_free(vterm);
+}
+
+void TestScrollback::budget()
+{
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+
+    Scrollback scrollback(100000, 1000);
+    scrollback.setBudget(1 << 20);
+    std::vector<VTermScreenCell> cells(cols);
+    for (uint32_t n = 0; n < 50000; ++n) {
+        fillLine(cells.data(), n);
+        scrollback.emplace(cols, cells.data(), palette, false);
+    }
+    QVERIFY(scrollback.usage().bytes <= 1 << 20);
+    QVERIFY(scrollback.usage().bytes > 1 << 19);
+
+    // Lowering the budget gives up the memory of the uncompressed lines too
+    size_t lines = scrollback.size();
+    scrollback.setBudget(1 << 18);
+    QVERIFY(scrollback.usage().bytes <= 1 << 18);
+    QVERIFY(scrollback.size() < lines);
+    QVERIFY(scrollback.size() > 0);
+
+    vterm_free(vterm);
+}
+
+QTEST_APPLESS_MAIN(TestScrollback)
+#include "tst_scrollback.moc"
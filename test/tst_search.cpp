@@ -0,0 +1,129 @@
+#include <QtTest>
+
+#include <palette.hpp>
+#include <scrollback.hpp>
+#include <search.hpp>
+#include <trigramindex.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+constexpr int cols = 40;
+
+void fillLine(VTermScreenCell *cells, const char *text)
+{
+    memset(cells, 0, sizeof(VTermScreenCell) * cols);
+    for (int i = 0; i < cols; ++i) {
+        if (*text)
+            cells[i].chars[0] = static_cast<uint32_t>(*text++);
+        cells[i].width = 1;
+    }
+}
+} // namespace
+
+class TestSearch : public QObject {
+    Q_OBJECT
+
+private slots:
+    void requiredText();
+    void requiredTextUrl();
+    void urlFilter();
+    void variedText();
+};
+
+void TestSearch::requiredText()
+{
+    auto text = [](const char *pattern) {
+        return Search::requiredText(QRegularExpression(pattern));
+    };
+
+    QCOMPARE(text("error: expected"), QStringList{"error: expected"});
+    QCOMPARE(text("(?:foo|bars)baz"), QStringList{"baz"});
+    QCOMPARE(text("(?:foox|barsx)baz"), (QStringList{"foox", "barsx"}));
+    QCOMPARE(text("colou?r"), QStringList{"colo"});
+    QCOMPARE(text("\\x41bcd"), QStringList{"bcd"});
+    QCOMPARE(text("a+bcd"), QStringList{"bcd"});
+    QCOMPARE(text("(?=abcd)xy"), QStringList{"xy"});
+
+    // Nothing every match has to contain
+    QCOMPARE(text("abc|.*"), QStringList());
+    QCOMPARE(text("(?:abcd)?"), QStringList());
+    QCOMPARE(text("(?x) abcd"), QStringList());
+    QCOMPARE(text("(abcd"), QStringList());
+}
+
+void TestSearch::requiredTextUrl()
+{
+    QRegularExpression re(urlMatch,
+            QRegularExpression::DotMatchesEverythingOption | QRegularExpression::CaseInsensitiveOption);
+
+    QCOMPARE(Search::requiredText(re), (QStringList{"http", "ftp://", "news://", "mailto:", "file://", "www."}));
+}
+
+void TestSearch::urlFilter()
+{
+    VTerm *vterm = vterm_new(24, cols);
+    Palette palette;
+    palette.load(vterm_obtain_state(vterm));
+
+    // A URL only in the second group of lines
+    constexpr uint64_t lines = TrigramIndex::groupLines * 4;
+    constexpr uint64_t url = TrigramIndex::groupLines + 10;
+    Scrollback scrollback(lines, 16);
+    std::vector<VTermScreenCell> cells(cols);
+    for (uint64_t i = 0; i < lines; ++i) {
+        fillLine(cells.data(), i == url ? "see HTTPS://example.org" : "make[2]: Leaving directory");
+        scrollback.emplace(cols, cells.data(), palette, false);
+    }
+
+    QRegularExpression re(urlMatch,
+            QRegularExpression::DotMatchesEverythingOption | QRegularExpression::CaseInsensitiveOption);
+    LineFilter filter = scrollback.filter(Search::requiredText(re));
+
+    uint64_t first = scrollback.serial() - lines;
+    QVERIFY(filter.wanted(first + url, first + url));
+    for (uint64_t group = 0; group < 4; ++group) {
+        uint64_t start = first + group * TrigramIndex::groupLines;
+        QCOMPARE(filter.wanted(start, start + TrigramIndex::groupLines - 1), group == 1);
+    }
+
+    vterm_free(vterm);
+}
+
+void TestSearch::variedText()
+{
+    // Random printable characters, with about as many distinct trigrams as
+    // characters, and some text to look for in just one group
+    constexpr uint64_t groups = 8;
+    constexpr uint64_t marked = 5;
+    const char *needle = "needle in a haystack";
+    const char *leaving = "make[2]: Leaving directory";
+    std::vector<uint32_t> same(leaving, leaving + strlen(leaving));
+    TrigramIndex varied;
+    TrigramIndex repeated;
+    unsigned seed = 1;
+    std::vector<uint32_t> line(200);
+    for (uint64_t seq = 0; seq < groups * TrigramIndex::groupLines; ++seq) {
+        for (auto &c : line)
+            c = static_cast<uint32_t>('!' + rand_r(&seed) % 94);
+        if (seq == marked * TrigramIndex::groupLines + 3)
+            std::copy(needle, needle + strlen(needle), line.begin());
+        varied.add(seq, false, line.data(), line.size());
+        repeated.add(seq, false, same.data(), same.size());
+    }
+
+    LineFilter filter = varied.query(QString(needle));
+    for (uint64_t group = 0; group < groups; ++group) {
+        uint64_t start = group * TrigramIndex::groupLines;
+        QCOMPARE(filter.wanted(start, start + TrigramIndex::groupLines - 1), group == marked);
+    }
+
+    // Fewer distinct trigrams take less room once a group is complete
+    QVERIFY(repeated.bytes() < varied.bytes() / 4);
+}
+
+QTEST_APPLESS_MAIN(TestSearch)
+#include "tst_search.moc"
@@ -0,0 +1,114 @@
+#include <QtTest>
+
+#include <syncupdate.hpp>
+
+#include <cstring>
+
+namespace {
+const char query[] = "\x1b[?2026$p";
+const char set[] = "\x1b[?2026;1$y";
+const char reset[] = "\x1b[?2026;2$y";
+
+// Scan all of data, collecting what libvterm would be fed and the replies
+void scanAll(SyncUpdate *sync, const char *data, QByteArray *fed, QByteArray *replies)
+{
+    QByteArray feed;
+    QByteArray reply;
+    size_t len = strlen(data);
+    size_t done = 0;
+    while (done < len) {
+        done += sync->scan(data + done, len - done, &feed, &reply);
+        fed->append(feed);
+        replies->append(reply);
+    }
+}
+} // namespace
+
+class TestSyncUpdate : public QObject {
+    Q_OBJECT
+
+private slots:
+    void markers();
+    void reply();
+    void replyDuringUpdate();
+    void replySplit();
+    void otherSequences();
+};
+
+void TestSyncUpdate::markers()
+{
+    SyncUpdate sync;
+    QByteArray fed;
+    QByteArray replies;
+
+    scanAll(&sync, "a\x1b[?2026hb", &fed, &replies);
+    QVERIFY(sync.active());
+    scanAll(&sync, "c\x1b[?2026l", &fed, &replies);
+    QVERIFY(!sync.active());
+
+    // Markers still reach libvterm, which ignores them
+    QCOMPARE(fed, QByteArray("a\x1b[?2026hbc\x1b[?2026l"));
+    QVERIFY(replies.isEmpty());
+}
+
+void TestSyncUpdate::reply()
+{
+    SyncUpdate sync;
+    QByteArray fed;
+    QByteArray replies;
+
+    scanAll(&sync, "a\x1b[?2026$pb", &fed, &replies);
+    QCOMPARE(replies, QByteArray(reset));
+
+    // libvterm would answer that it doesn't know the mode
+    QCOMPARE(fed, QByteArray("ab"));
+}
+
+void TestSyncUpdate::replyDuringUpdate()
+{
+    SyncUpdate sync;
+    QByteArray fed;
+    QByteArray replies;
+
+    scanAll(&sync, "\x1b[?2026h", &fed, &replies);
+    scanAll(&sync, query, &fed, &replies);
+    QCOMPARE(replies, QByteArray(set));
+}
+
+void TestSyncUpdate::replySplit()
+{
+    SyncUpdate sync;
+    QByteArray fed;
+    QByteArray replies;
+
+    // Split at every possible byte
+    for (size_t i = 1; i < strlen(query); ++i) {
+        QByteArray first(query, static_cast<int>(i));
+        QByteArray second(query + i);
+        fed.clear();
+        replies.clear();
+        scanAll(&sync, first.constData(), &fed, &replies);
+        QVERIFY(fed.isEmpty());
+        scanAll(&sync, second.constData(), &fed, &replies);
+        QVERIFY(fed.isEmpty());
+        QCOMPARE(replies, QByteArray(reset));
+    }
+}
+
+void TestSyncUpdate::otherSequences()
+{
+    SyncUpdate sync;
+    QByteArray fed;
+    QByteArray replies;
+
+    // Other modes, other queries and a stray escape go through untouched
+    const char *data = "\x1b[?1049h\x1b[?20261h\x1b[?2026$q\x1b\x1b[?2025$p\x1b[?2026";
+    scanAll(&sync, data, &fed, &replies);
+    scanAll(&sync, "x", &fed, &replies);
+    QCOMPARE(fed, QByteArray(data) + QByteArray("x"));
+    QVERIFY(replies.isEmpty());
+    QVERIFY(!sync.active());
+}
+
+QTEST_APPLESS_MAIN(TestSyncUpdate)
+#include "tst_syncupdate.moc"